@@ -0,0 +1,172 @@
+#include <MycilaConfig.h>
+#include <StreamString.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+
+// mixed schema: a quarter each of bool, int, short string and long string keys
+// about 230 NVS entries: a string takes one entry plus one per 32 bytes, and the default nvs partition holds about 500 entries
+#define KEY_COUNT  128
+#define ITERATIONS 4
+
+Mycila::Config config;
+
+static char names[KEY_COUNT][MYCILA_CONFIG_KEY_MAX_LENGTH + 1];
+static std::string values[KEY_COUNT];
+static std::string others[KEY_COUNT];
+static Mycila::ConfigKeyId ids[KEY_COUNT];
+
+// discards the output, to time the serialization only
+class NullPrint : public Print {
+  public:
+    size_t write(uint8_t) override { return 1; }
+    size_t write(const uint8_t*, size_t size) override { return size; }
+};
+
+// runs code(i) for i in [0, count) and reports the cost of one run
+// the cycle counter wraps after a few seconds: keep each measure short
+template <typename F>
+static void bench(const char* name, size_t count, F&& code) {
+  const int64_t start = esp_timer_get_time();
+  const uint32_t startCycles = ESP.getCycleCount();
+  for (size_t i = 0; i < count; i++)
+    code(i);
+  const uint32_t cycles = ESP.getCycleCount() - startCycles;
+  const int64_t us = esp_timer_get_time() - start;
+  Serial.printf("%-20s %6u runs %10" PRIu32 " cycles/run %10.2f us/run\n", name, static_cast<unsigned>(count), static_cast<uint32_t>(cycles / count), static_cast<float>(us) / count);
+}
+
+static void heap(const char* when) {
+  const uint32_t free = ESP.getFreeHeap();
+  const uint32_t largest = ESP.getMaxAllocHeap();
+  Serial.printf("heap %-16s free: %" PRIu32 ", min free: %" PRIu32 ", largest block: %" PRIu32 ", fragmentation: %.1f%%\n",
+                when,
+                free,
+                ESP.getMinFreeHeap(),
+                largest,
+                free ? 100.0f * (1.0f - static_cast<float>(largest) / free) : 0);
+}
+
+// stops the benchmark when a write fails: its timings would be meaningless
+static void check(bool ok, const char* what, size_t i) {
+  if (!ok) {
+    Serial.printf("%s(%s) failed\n", what, names[i]);
+    abort();
+  }
+}
+
+static std::string value(size_t i, char c) {
+  switch (i % 4) {
+    case 0:
+      return c % 2 ? "true" : "false";
+    case 1:
+      return std::to_string(i * 1000 + c);
+    case 2:
+      return std::string(8 + i % 8, c);
+    default:
+      return std::string(32 + i % 32, c);
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    continue;
+
+  Serial.printf("MycilaConfig %s, %" PRIu32 " MHz, %d keys\n", MYCILA_CONFIG_VERSION, ESP.getCpuFreqMHz(), KEY_COUNT);
+  heap("start");
+
+  config.begin("BENCH");
+  config.clear();
+
+  for (size_t i = 0; i < KEY_COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "%c_key_%03u", "bisl"[i % 4], static_cast<unsigned>(i));
+    values[i] = value(i, 'a' + i % 26);
+    others[i] = value(i, 'a' + (i + 1) % 26);
+  }
+
+  // configure()
+
+  config.reserve(KEY_COUNT);
+  bench("configure", KEY_COUNT, [](size_t i) {
+    switch (i % 4) {
+      case 0:
+        config.configure(names[i], "false", Mycila::ConfigType::BOOL);
+        break;
+      case 1:
+        config.configure(names[i], "0", Mycila::ConfigType::INT, true);
+        break;
+      default:
+        config.configure(names[i], "");
+        break;
+    }
+  });
+  heap("configured");
+
+  // set()
+
+  bench("set", KEY_COUNT, [](size_t i) { check(config.set(names[i], values[i]), "set", i); });
+  bench("set unchanged", KEY_COUNT, [](size_t i) { check(!config.set(names[i], values[i]), "set unchanged", i); });
+  for (size_t i = 0; i < KEY_COUNT; i++)
+    ids[i] = config.keyId(names[i]);
+  bench("set by id", KEY_COUNT, [](size_t i) { check(config.set(ids[i], others[i].c_str()), "set by id", i); });
+  heap("set");
+
+  // get()
+
+  // empty the cache: the next reads are loaded from NVS
+  config.setCachePolicy(Mycila::ConfigCachePolicy::NONE);
+  bench("get uncached", KEY_COUNT, [](size_t i) { config.get(names[i]); });
+  config.setCachePolicy(Mycila::ConfigCachePolicy::FULL);
+  bench("get cold", KEY_COUNT, [](size_t i) { config.get(names[i]); });
+  bench("get warm", KEY_COUNT * ITERATIONS, [](size_t i) { config.get(names[i % KEY_COUNT]); });
+  bench("get by id", KEY_COUNT * ITERATIONS, [](size_t i) { config.get(static_cast<Mycila::ConfigKeyId>(i % KEY_COUNT)); });
+  bench("getBool", KEY_COUNT / 4 * ITERATIONS, [](size_t i) { config.getBool(names[i % (KEY_COUNT / 4) * 4]); });
+  bench("getLong", KEY_COUNT / 4 * ITERATIONS, [](size_t i) { config.getLong(names[i % (KEY_COUNT / 4) * 4 + 1]); });
+  heap("get");
+
+  // backup() / restore()
+
+  StreamString backup;
+  backup.reserve(config.beginBackup().size());
+  bench("backup", 1, [&backup](size_t) { config.backup(backup); });
+
+  StreamString binary;
+  bench("backupBinary", 1, [&binary](size_t) { config.backupBinary(binary); });
+
+  NullPrint null;
+  bench("backup (no copy)", ITERATIONS, [&null](size_t) { config.backup(null); });
+  bench("toJson(Print)", ITERATIONS, [&null](size_t) { config.toJson(null); });
+
+  // restore the values set by key
+  bench("restore unchanged", 1, [&backup](size_t) { config.restore(backup.c_str()); });
+  for (size_t i = 0; i < KEY_COUNT; i++)
+    check(config.set(names[i], value(i, 'a' + (i + 2) % 26), false), "set", i);
+  bench("restore", 1, [&backup](size_t) { config.restore(backup.c_str()); });
+  for (size_t i = 0; i < KEY_COUNT; i++)
+    check(config.set(names[i], value(i, 'a' + (i + 2) % 26), false), "set", i);
+  bench("restoreBinary", 1, [&binary](size_t) { config.restoreBinary(reinterpret_cast<const uint8_t*>(binary.c_str()), binary.length()); });
+  heap("restore");
+
+#ifdef MYCILA_JSON_SUPPORT
+  JsonDocument doc;
+  bench("toJson(JsonObject)", ITERATIONS, [&doc](size_t) {
+    doc.clear();
+    config.toJson(doc.to<JsonObject>());
+  });
+  doc.clear();
+  heap("json");
+#endif
+
+#ifdef MYCILA_CONFIG_STATS
+  Mycila::ConfigStats stats = config.stats();
+  Serial.printf("nvs reads: %" PRIu32 ", writes: %" PRIu32 ", removes: %" PRIu32 ", bytes persisted: %" PRIu32 "\n", stats.nvsReads, stats.nvsWrites, stats.nvsRemoves, stats.bytesPersisted);
+  Serial.printf("cache hits: %" PRIu32 ", misses: %" PRIu32 ", evictions: %" PRIu32 "\n", stats.cacheHits, stats.cacheMisses, config.cacheEvictions());
+#endif
+
+  config.clear();
+  Serial.println("done");
+}
+
+void loop() {
+  vTaskDelete(NULL);
+}
@@ -1,8 +1,30 @@
 #include <MycilaConfig.h>
+#include <StreamString.h>
 
 Mycila::Config config;
 Preferences prefs;
 
+static constexpr Mycila::ConfigKey SCHEMA[] = {
+  {"s_bool", "true", Mycila::ConfigType::BOOL},
+  {"s_int", "42", Mycila::ConfigType::INT},
+  {"s_float", "1.5", Mycila::ConfigType::FLOAT, true},
+};
+static constexpr Mycila::ConfigKeyId KEY_S_BOOL = Mycila::Config::keyId(SCHEMA, "s_bool");
+static constexpr Mycila::ConfigKeyId KEY_S_INT = Mycila::Config::keyId(SCHEMA, "s_int");
+static constexpr Mycila::ConfigKeyId KEY_S_FLOAT = Mycila::Config::keyId(SCHEMA, "s_float");
+
+// accepts at most 100 bytes per write, like a network client with a full buffer
+class PartialPrint : public Print {
+  public:
+    std::string data;
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size) override {
+      size = std::min<size_t>(size, 100);
+      data.append(reinterpret_cast<const char*>(buffer), size);
+      return size;
+    }
+};
+
 static void assertEquals(const char* actual, const char* expected) {
   if (strcmp(actual, expected) != 0) {
     Serial.printf("Expected '%s' but got '%s'\n", expected, actual);
@@ -16,9 +38,15 @@ void setup() {
     continue;
 
   // prepare storage for tests
+  // the atomic restores of a previous run may have left CONFIG~ active: go back to CONFIG
+  prefs.begin("mycila_config", false);
+  prefs.clear();
+  prefs.end();
   prefs.begin("CONFIG", false);
   prefs.clear();
   prefs.putString("key4", "bar");
+  // persisted as a string before the key became native
+  prefs.putString("s_float", "1.5");
   prefs.end();
   prefs.begin("CONFIG", true);
 
@@ -38,12 +66,22 @@ void setup() {
 
   // configure()
 
+  config.configure(SCHEMA);
+  config.reserve(10);
+  config.configure({
+    {"b_key2", "b", Mycila::ConfigType::STRING},
+    {"b_key1", "a", Mycila::ConfigType::STRING},
+  });
+  // a duplicated key rejects the whole table
+  assert(config.configure({{"dup_key", "1"}, {"dup_key2", "2"}, {"dup_key", "3"}}) == Mycila::CONFIG_KEY_UNKNOWN);
+  assert(config.keyId("dup_key2") == Mycila::CONFIG_KEY_UNKNOWN);
   config.configure("key1", "false");
   config.configure("key2", "");
   config.configure("key3");
   config.configure("key4", "foo");
   config.configure("key5", "baz");
   config.configure("key6", std::to_string(6));
+  config.configure("wifi_pwd", "secret");
 
   // tests
 
@@ -62,7 +100,7 @@ void setup() {
   // cache stored key
   assertEquals(config.get("key4"), "bar"); // load key and cache
 
-  // set key to same value => no change
+  // set key to same value => no change, answered from the cache
   assert(!config.set("key4", "bar"));
 
   // set stored key to default value
@@ -96,10 +134,473 @@ void setup() {
 
   config.backup(Serial);
   config.restore("key1=\nkey2=\nkey3=value3\nkey4=foo\n");
+  assertEquals(config.get("key3"), "value3");
+
+  // restore: keys must match exactly and the last record must be terminated
+  assert(!config.restore("xkey3=other\n"));
+  assert(!config.restore("key3=other"));
+  assertEquals(config.get("key3"), "value3");
+
+  // restore from a stream
+  StreamString upload;
+  upload.print("key3=streamed\r\nunknown=1\r\n");
+  assert(config.restore(upload));
+  assertEquals(config.get("key3"), "streamed");
 
   assertEquals(config.get("key6"), "6");
   config.set("key6", std::to_string(7));
   assertEquals(config.get("key6"), "7");
+  assert(config.isEqual("key6", "7"));
+  assert(config.isEqual(config.keyId("key6"), std::string("7")));
+  assert(!config.isEmpty("key6"));
+  assert(config.isEmpty("unknown_key"));
+
+  // ID-based access
+  assert(config.getBool(KEY_S_BOOL));
+  assert(config.getInt(KEY_S_INT) == 42);
+  assert(config.set(KEY_S_INT, "43"));
+  assert(config.getInt(KEY_S_INT) == 43);
+  assert(config.keyId("key6") == 10);
+  assert(config.keyId("b_key1") == 4);
+  assertEquals(config.keys()[0], "b_key1");
+  assertEquals(config.get("b_key2"), "b");
+  assert(config.getInt(config.keyId("key6")) == 7);
+
+  // typed keys
+  assert(config.getFloat(KEY_S_FLOAT) == 1.5f);
+  assert(config.set(KEY_S_FLOAT, "2.250"));
+  // native keys get the value as it is read back from NVS
+  assertEquals(config.get(KEY_S_FLOAT), "2.25");
+  assert(!config.set(KEY_S_FLOAT, "2.25"));
+  assert(config.getFloat(KEY_S_FLOAT) == 2.25f);
+  assert(prefs.getFloat("s_float") == 2.25f);
+  // 8 significant digits are kept
+  assert(config.set(KEY_S_FLOAT, "12345678"));
+  assertEquals(config.get(KEY_S_FLOAT), "12345678");
+  assert(config.getFloat(KEY_S_FLOAT) == 12345678.f);
+  assert(config.set(KEY_S_FLOAT, "2.25"));
+  assert(config.getInt("key3") == 0);
+
+  // snapshots
+  Mycila::Config::Snapshot snapshot = config.snapshot();
+  assert(snapshot.generation() == config.generation());
+  assert(config.snapshot().generation() == snapshot.generation());
+  assert(snapshot.getInt(KEY_S_INT) == 43);
+  assertEquals(snapshot.get("key6"), "7");
+  assert(config.set(KEY_S_INT, "45"));
+  assert(config.generation() != snapshot.generation());
+  assert(snapshot.getInt(KEY_S_INT) == 43);
+  assert(config.snapshot().getInt(KEY_S_INT) == 45);
+  assert(config.set(KEY_S_INT, "43"));
+
+  // lookups by content
+  char buffer[] = "key6";
+  assert(config.keyRef(buffer) != buffer);
+  assertEquals(config.keyRef(buffer), "key6");
+  assertEquals(config.get(buffer), "7");
+  assertEquals(config.get(std::string_view("key6_enable", 4)), "7");
+  assert(config.keyRef("key7") == nullptr);
+
+  // write-behind
+  config.setWriteBehind(1000);
+  assert(config.set("key2", "wb"));
+  assert(!config.set("key2", "wb"));
+  assertEquals(config.get("key2"), "wb");
+  assert(!prefs.isKey("key2"));
+  assert(config.flush() == 1);
+  assert(prefs.isKey("key2"));
+  assert(config.unset("key2"));
+  assertEquals(config.get("key2"), "");
+  assert(prefs.isKey("key2"));
+  config.setWriteBehind(0);
+  assert(!prefs.isKey("key2"));
+
+  // preload
+  config.preload();
+  assertEquals(config.get("key6"), "7");
+  assert(config.getFloat(KEY_S_FLOAT) == 2.25f);
+
+  // cache policies
+  config.setCachePolicy(Mycila::ConfigCachePolicy::LRU, 8);
+  assert(config.cacheSize() <= 8);
+  assert(config.cacheEvictions() > 0);
+  assertEquals(config.get("key6"), "7");
+  assertEquals(config.get("key5"), "baz");
+  config.setCachePolicy(Mycila::ConfigCachePolicy::NONE);
+  assertEquals(config.get("key6"), "7");
+  assertEquals(config.get("key5"), "baz");
+  assert(config.cacheSize() == 1); // default values are never copied in cache
+  config.setCachePolicy(Mycila::ConfigCachePolicy::FULL);
+
+  // transactions
+  {
+    Mycila::Config::Transaction tx = config.beginTransaction();
+    assert(tx.set("key2", "tx1"));
+    assert(tx.set("key2", "tx2"));
+    assert(tx.set(KEY_S_INT, "44"));
+    assert(!tx.set("unknown", "value"));
+    assertEquals(config.get("key2"), "");
+    assert(tx.commit());
+    assertEquals(config.get("key2"), "tx2");
+    assert(config.getInt(KEY_S_INT) == 44);
+  }
+  {
+    Mycila::Config::Transaction tx = config.beginTransaction();
+    tx.unset("key2");
+    tx.rollback();
+    assert(!tx.commit());
+    assertEquals(config.get("key2"), "tx2");
+  }
+
+  // pull-based backup, independent of the chunk size
+  {
+    StreamString full;
+    config.backup(full);
+    Mycila::Config::Backup backup = config.beginBackup();
+    assert(backup.size() == full.length());
+    std::string chunked;
+    uint8_t chunk[3];
+    size_t length;
+    while ((length = backup.read(chunk, sizeof(chunk))) > 0)
+      chunked.append(reinterpret_cast<char*>(chunk), length);
+    assert(chunked == full.c_str());
+
+    char masked[256] = {0};
+    config.beginBackup(true).read(reinterpret_cast<uint8_t*>(masked), sizeof(masked) - 1);
+    assert(strstr(masked, "\nwifi_pwd=" MYCILA_CONFIG_PASSWORD_MASK "\n"));
+  }
+
+  // JSON written straight to a Print
+  {
+    const std::string key2 = config.getString("key2");
+    config.set("key2", "a\"b");
+    StreamString json;
+    config.toJson(json);
+    assert(json.c_str()[0] == '{');
+    assert(strstr(json.c_str(), "\"key2\":\"a\\\"b\","));
+    assert(strstr(json.c_str(), "\"wifi_pwd\":\"" MYCILA_CONFIG_PASSWORD_MASK "\"}"));
+    config.set("key2", key2);
+  }
+
+  // subscriptions
+  {
+    int keyChanges = 0;
+    int prefixChanges = 0;
+    Mycila::ConfigSubscriptionId subscription = config.subscribe("key5", [&keyChanges](const char* key, const std::string&) {
+      assertEquals(key, "key5");
+      keyChanges++;
+    });
+    Mycila::ConfigSubscriptionId prefixSubscription = config.subscribePrefix("s_", [&prefixChanges](const char*, const std::string&) { prefixChanges++; });
+    assert(config.set("key5", "sub"));
+    assert(config.set(KEY_S_INT, "45"));
+    assert(config.set("key3", "other"));
+    assert(keyChanges == 1);
+    assert(prefixChanges == 1);
+    assert(config.unsubscribe(subscription));
+    assert(!config.unsubscribe(subscription));
+    assert(config.unset("key5"));
+    assert(keyChanges == 1);
+    assert(config.unsubscribe(prefixSubscription));
+
+    // a callback can unsubscribe itself and subscribe another one
+    Mycila::ConfigSubscriptionId once = 0;
+    int onceChanges = 0;
+    once = config.subscribe("key5", [&](const char*, const std::string&) {
+      onceChanges++;
+      assert(config.unsubscribe(once));
+      once = config.subscribe("key5", [&onceChanges](const char*, const std::string&) { onceChanges += 10; });
+    });
+    assert(config.set("key5", "once"));
+    assert(onceChanges == 1);
+    assert(config.set("key5", "twice"));
+    assert(onceChanges == 11);
+    assert(config.unsubscribe(once));
+    assert(config.unset("key5"));
+  }
+
+  // asynchronous dispatch
+  {
+    TaskHandle_t caller = xTaskGetCurrentTaskHandle();
+    TaskHandle_t dispatcher = caller;
+    int changes = 0;
+    bool refused = false;
+    Mycila::ConfigSubscriptionId subscription = config.subscribe("key5", [&](const char*, const std::string&) {
+      dispatcher = xTaskGetCurrentTaskHandle();
+      // the dispatch task cannot stop itself
+      if (!changes++)
+        refused = !config.setAsyncDispatch(0);
+    });
+    assert(config.setAsyncDispatch(4));
+    assert(config.set("key5", "async1"));
+    assert(config.set("key5", "async2"));
+    assert(config.unset("key5"));
+    // delivers the queued events
+    assert(config.setAsyncDispatch(0));
+    assert(changes == 3);
+    assert(dispatcher != caller);
+    assert(refused);
+    assert(config.droppedEvents() == 0);
+
+    // the stop is not dropped when the queue is full
+    assert(config.setAsyncDispatch(1, Mycila::ConfigDispatchOverflow::DROP_OLDEST));
+    for (int i = 0; i < 8; i++)
+      assert(config.set("key5", std::to_string(i)));
+    assert(config.setAsyncDispatch(0));
+    assert(changes + config.droppedEvents() == 11);
+    config.unsubscribe(subscription);
+  }
+
+  // batched notifications
+  {
+    int batches = 0;
+    std::vector<Mycila::ConfigKeyId> changed;
+    Mycila::ConfigSubscriptionId subscription = config.subscribeBatch("key", 50, [&](const std::vector<Mycila::ConfigKeyId>& keys) {
+      batches++;
+      changed = keys;
+    });
+    for (int i = 0; i < 10; i++)
+      config.set("key5", std::to_string(i));
+    config.set("key3", "batch");
+    config.set(KEY_S_INT, "46");
+    config.unset("key5");
+    delay(100);
+    assert(batches == 1);
+    assert(changed.size() == 2);
+    assert(changed[0] == config.keyId("key3"));
+    assert(changed[1] == config.keyId("key5"));
+    config.unsubscribe(subscription);
+  }
+
+  // delta export
+  {
+    const uint32_t since = config.generation();
+    config.set("key3", "delta");
+    config.set("key5", "delta");
+    config.unset("key5");
+    StreamString delta;
+    const uint32_t generation = config.delta(since, delta);
+    assert(generation == config.generation());
+    assertEquals(delta.c_str(), "key3=delta\nkey5=\n");
+    assert(!config.restore(delta.c_str()));
+    StreamString empty;
+    config.delta(generation, empty);
+    assert(empty.length() == 0);
+  }
+
+  // binary backup
+  {
+    config.set("key3", "multi\nline=value");
+    StreamString binary;
+    const size_t size = config.backupBinary(binary);
+    assert(size == binary.length());
+    config.set("key3", "other");
+    assert(config.restoreBinary(reinterpret_cast<const uint8_t*>(binary.c_str()), binary.length()));
+    assertEquals(config.get("key3"), "multi\nline=value");
+    config.set("key3", "other");
+    assert(config.restoreBinary(binary));
+    assertEquals(config.get("key3"), "multi\nline=value");
+    std::string corrupted(binary.c_str(), size);
+    corrupted[size - 1] ^= 1;
+    config.set("key3", "other");
+    assert(!config.restoreBinary(reinterpret_cast<const uint8_t*>(corrupted.data()), corrupted.size()));
+    assert(!config.restoreBinary(reinterpret_cast<const uint8_t*>(corrupted.data()), size - 5));
+    assertEquals(config.get("key3"), "other");
+  }
+
+  // RAM storage
+  {
+    Mycila::ConfigRAMStorage ram;
+    Mycila::Config volatileConfig;
+    volatileConfig.configure("key1", "a");
+    volatileConfig.configure("key2", "1", Mycila::ConfigType::INT, true);
+    volatileConfig.begin(ram, "RAM", true);
+    assert(volatileConfig.set("key1", "b"));
+    assert(volatileConfig.set("key2", "2"));
+    // NVS is not touched
+    assert(prefs.getString("key1") != "b");
+    assert(ram.type("key2") == Mycila::ConfigStorageType::LONG);
+    assert(volatileConfig.getLong("key2") == 2);
+    volatileConfig.clear();
+    assertEquals(volatileConfig.get("key1"), "a");
+    assert(!ram.isKey("key1"));
+  }
+
+  // prefix queries over the sorted keys
+  {
+    Mycila::ConfigKeyRange range = config.keys("key");
+    assert(range.size() == 6);
+    assertEquals(range[0], "key1");
+    assertEquals(range[5], "key6");
+    assert(config.keys("b_").size() == 2);
+    assert(config.keys("z").empty());
+    assert(config.keys("").size() == config.keys().size());
+    StreamString json;
+    config.toJson(json, "b_");
+    assertEquals(json.c_str(), "{\"b_key1\":\"a\",\"b_key2\":\"b\"}");
+    StreamString group;
+    config.backup(group, "b_");
+    assertEquals(group.c_str(), "b_key1=a\nb_key2=b\n");
+    assert(config.restore("b_key1=c\nkey5=d\n", "b_"));
+    assertEquals(config.get("b_key1"), "c");
+    assertEquals(config.get("key5"), "baz");
+    config.unset("b_key1");
+  }
+
+  // shards: the mqtt_ keys go to their own storage
+  {
+    Mycila::ConfigRAMStorage main;
+    Mycila::ConfigRAMStorage mqtt;
+    Mycila::Config sharded;
+    sharded.configure("wifi_ssid", "home");
+    sharded.configure("mqtt_server", "broker");
+    assert(sharded.shard("mqtt_", mqtt, "MQTT", true));
+    assert(!sharded.shard("mqtt_", mqtt, "MQTT"));
+    sharded.configure("mqtt_port", "1883", Mycila::ConfigType::INT, true);
+    sharded.begin(main, "MAIN");
+    assert(!sharded.shard("wifi_", main, "WIFI"));
+    assert(sharded.set("wifi_ssid", "office"));
+    assert(sharded.set("mqtt_server", "remote"));
+    assert(sharded.set("mqtt_port", "8883"));
+    assert(main.isKey("wifi_ssid") && !main.isKey("mqtt_server"));
+    assert(mqtt.isKey("mqtt_server") && mqtt.type("mqtt_port") == Mycila::ConfigStorageType::LONG);
+    StreamString group;
+    sharded.backup(group, "mqtt_");
+    assertEquals(group.c_str(), "mqtt_port=8883\nmqtt_server=remote\n");
+    assert(sharded.clear("mqtt_"));
+    assert(!sharded.clear("wifi_"));
+    assertEquals(sharded.get("mqtt_server"), "broker");
+    assertEquals(sharded.get("wifi_ssid"), "office");
+    assert(!mqtt.isKey("mqtt_port") && main.isKey("wifi_ssid"));
+  }
+
+#ifdef MYCILA_CONFIG_STATS
+  // performance counters
+  {
+    config.resetStats();
+    config.set("key3", "stats");
+    assertEquals(config.get("key3"), "stats");
+    Mycila::ConfigStats stats = config.stats();
+    assert(stats.set.count == 1);
+    assert(stats.get.count == 1);
+    assert(stats.cacheHits == 1);
+    assert(stats.nvsWrites == 1);
+    assert(stats.bytesPersisted == 5);
+    assert(stats.callbacks.count > 0);
+    assert(stats.get.min <= stats.get.max);
+
+    // a removal deferred by the write-behind is counted once, when flushed
+    config.setWriteBehind(1000);
+    assert(config.unset("key3"));
+    config.flush();
+    config.setWriteBehind(0);
+    assert(config.stats().nvsRemoves == 1);
+    config.resetStats();
+    assert(config.stats().get.count == 0 && config.stats().get.min == 0);
+  }
+#endif
+
+  // value pool
+  assert(config.setPool(4, 64));
+  assertEquals(config.get("key2"), "tx2");
+  for (int i = 0; i < 20; i++) {
+    config.set("key2", std::string(20 + i % 3, 'a' + i % 26));
+    config.set("key4", i % 2 ? "short" : "a value longer than a slot");
+  }
+  assert(config.get("key4")[0] == 's');
+  assert(config.getString("key2").length() == 21);
+  Mycila::ConfigPoolStats stats = config.poolStats();
+  assert(stats.slots == 4);
+  assert(stats.arenaUsed <= 64);
+  assert(stats.overflows == 0);
+  assert(config.setPool(0, 0));
+  assert(config.getString("key2").length() == 21);
+
+  // all the slots used: a short value goes to the arena without evicting the value of the slot
+  assert(config.setPool(1, 64));
+  config.set("key3", "slot");
+  assert(config.poolStats().slotsUsed == 1);
+  const uint32_t evictions = config.cacheEvictions();
+  config.set("key4", "arena");
+  assert(config.cacheEvictions() == evictions);
+  assert(config.poolStats().arenaUsed > 0);
+  assertEquals(config.get("key3"), "slot");
+  assertEquals(config.get("key4"), "arena");
+  // a value copied from the pool, which is compacted to make room for the copy
+  assert(config.setPool(0, 64));
+  config.set("key3", std::string(20, 'a'));
+  config.set("key4", std::string(20, 'b'));
+  config.unset("key3");
+  config.set("key5", config.get("key4"));
+  assertEquals(config.get("key5"), std::string(20, 'b').c_str());
+  config.unset("key5");
+  assert(config.setPool(0, 0));
+
+  // atomic restore: the values are rewritten in the staging namespace, which becomes the active one
+  {
+    config.setAtomicRestore(true);
+    const std::string key2 = config.getString("key2");
+    assert(config.restore("key3=atomic\nkey4=\n"));
+    Preferences staged;
+    staged.begin("CONFIG~", true);
+    assert(staged.getString("key3") == "atomic");
+    staged.end();
+    config.setCachePolicy(Mycila::ConfigCachePolicy::NONE);
+    assertEquals(config.get("key3"), "atomic");
+    assertEquals(config.get("key4"), "foo");
+    assert(config.getString("key2") == key2);
+    assert(!config.restore("key3=atomic\n"));
+    // back to the first namespace
+    assert(config.restore("key3=restored\n"));
+    assertEquals(config.get("key3"), "restored");
+    assert(config.getString("key2") == key2);
+    config.setCachePolicy(Mycila::ConfigCachePolicy::FULL);
+    config.setAtomicRestore(false);
+  }
+
+  // blobs: persisted in chunks, never cached
+  {
+    std::string cert(2 * MYCILA_CONFIG_BLOB_CHUNK_SIZE + 100, 'x');
+    for (size_t i = 0; i < cert.size(); i++)
+      cert[i] = 'a' + i % 26;
+    assert(config.configureBlob("tls_ca"));
+    assert(!config.configureBlob("key1"));
+    assert(!config.configureBlob("a_too_long_key"));
+    assert(config.blobSize("tls_ca") == 0);
+    assert(!config.unsetBlob("tls_ca"));
+    assert(config.setBlob("tls_ca", reinterpret_cast<const uint8_t*>(cert.data()), cert.size()));
+    assert(config.blobSize("tls_ca") == cert.size());
+    assert(prefs.isKey("tls_ca.02") && !prefs.isKey("tls_ca.03"));
+
+    // across the chunks
+    uint8_t part[50];
+    assert(config.readBlob("tls_ca", part, sizeof(part), MYCILA_CONFIG_BLOB_CHUNK_SIZE - 10) == sizeof(part));
+    assert(memcmp(part, cert.data() + MYCILA_CONFIG_BLOB_CHUNK_SIZE - 10, sizeof(part)) == 0);
+    assert(config.readBlob("tls_ca", part, sizeof(part), cert.size() - 20) == 20);
+    StreamString streamed;
+    assert(config.readBlob("tls_ca", streamed) == cert.size());
+    assert(cert == streamed.c_str());
+    PartialPrint partial;
+    assert(config.readBlob("tls_ca", partial) == cert.size());
+    assert(partial.data == cert);
+
+    // the chunks of a longer value are removed
+    assert(config.setBlob("tls_ca", reinterpret_cast<const uint8_t*>("short"), 5));
+    assert(config.blobSize("tls_ca") == 5);
+    assert(!prefs.isKey("tls_ca.01"));
+    assert(config.unsetBlob("tls_ca"));
+    assert(config.blobSize("tls_ca") == 0 && !prefs.isKey("tls_ca.00"));
+
+    // kept by the preload and by an atomic restore
+    assert(config.setBlob("tls_ca", reinterpret_cast<const uint8_t*>(cert.data()), cert.size()));
+    config.preload();
+    config.setAtomicRestore(true);
+    assert(config.restore("key3=blob\n"));
+    config.setAtomicRestore(false);
+    assert(config.blobSize("tls_ca") == cert.size());
+    StreamString restored;
+    config.readBlob("tls_ca", restored);
+    assert(cert == restored.c_str());
+  }
 }
 
 void loop() {
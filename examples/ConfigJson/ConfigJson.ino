@@ -28,6 +28,36 @@ void loop() {
   serializeJson(doc, Serial);
   Serial.println();
 
+  // values linked to a snapshot instead of being copied in the document
+  Mycila::Config::Snapshot snapshot = config.snapshot();
+  doc.clear();
+  config.toJson(doc.to<JsonObject>(), snapshot);
+  serializeJson(doc, Serial);
+  Serial.println();
+
+  // no JsonDocument at all
+  config.toJson(Serial);
+  Serial.println();
+
+  // only the wifi_ keys, for a settings page
+  doc.clear();
+  config.toJson(doc.to<JsonObject>(), "wifi_");
+  serializeJson(doc, Serial);
+  Serial.println();
+
+  // import a JSON object straight through a transaction
+  JsonDocument update;
+  deserializeJson(update, "{\"" KEY_WIFI_SSID "\":\"MyWifi\",\"unknown\":1}");
+  config.set(update.as<JsonObjectConst>());
+
+#ifdef MYCILA_CONFIG_STATS
+  // performance counters, for a metrics endpoint
+  doc.clear();
+  config.stats().toJson(doc.to<JsonObject>());
+  serializeJson(doc, Serial);
+  Serial.println();
+#endif
+
   StreamString content;
   content.reserve(1024);
   config.backup(content);
@@ -5,9 +5,25 @@
 #include "MycilaConfig.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+  #include <esp_memory_utils.h>
+  #include <esp_rom_crc.h>
+#else
+  #include <rom/crc.h>
+  #include <soc/soc_memory_layout.h>
+  #define esp_rom_crc32_le crc32_le
+#endif
+
+#ifdef MYCILA_CONFIG_STATS
+  #include <esp_timer.h>
+#endif
 
 #include <algorithm>
 #include <map>
+#include <new>
 #include <string>
 #include <utility>
 
@@ -27,233 +43,2573 @@ extern Mycila::Logger logger;
 
 #define TAG "CONFIG"
 
+#ifdef MYCILA_CONFIG_STATS
+  #define STATS_ADD(counter, n)    __atomic_fetch_add(&_stats.counter, n, __ATOMIC_RELAXED)
+  #define STATS_TIME(config, what) Mycila::Config::Stopwatch stopwatch((config)._stats.what)
+#else
+  #define STATS_ADD(counter, n)
+  #define STATS_TIME(config, what)
+#endif
+#define STATS_COUNT(counter) STATS_ADD(counter, 1)
+
+static bool _inFlash(const char* str) { return esp_ptr_in_drom(str); }
+
 Mycila::Config::~Config() {
-  _prefs.end();
+  setAsyncDispatch(0);
+  std::vector<Subscriber> subscribers;
+  {
+    std::lock_guard<std::mutex> lock(_subscribersMutex);
+    subscribers.swap(_subscribers);
+  }
+  for (Subscriber& subscriber : subscribers)
+    if (subscriber.batch)
+      _deleteBatch(std::move(subscriber.batch));
+  if (_flushTimer)
+    _deleteTimer(_flushTimer);
+  flush();
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    _storageAt(shard).end();
 }
 
-void Mycila::Config::begin(const char* name) {
+void Mycila::Config::begin(ConfigStorage& storage, const char* name, bool preload) {
   LOGI(TAG, "Initializing Config System: %s...", name);
-  _prefs.begin(name, false);
+  _begun = true;
+  _storage = &storage;
+  if (!_storage->begin(name))
+    LOGE(TAG, "Unable to open storage: %s", name);
+  for (Shard& shard : _shards)
+    if (!shard.storage->begin(shard.name.c_str()))
+      LOGE(TAG, "Unable to open storage: %s", shard.name.c_str());
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    if (shard ? _shards[shard - 1].preload : preload)
+      _preload(shard);
+}
+
+bool Mycila::Config::shard(const char* prefix, const char* name, bool preload) {
+  std::unique_ptr<ConfigNVSStorage> nvs(new ConfigNVSStorage());
+  if (!shard(prefix, *nvs, name, preload))
+    return false;
+  _shards.back().nvs = std::move(nvs);
+  return true;
+}
+
+bool Mycila::Config::shard(const char* prefix, ConfigStorage& storage, const char* name, bool preload) {
+  if (!prefix || !prefix[0] || _shardOf(prefix, true) != SIZE_MAX || _shards.size() == UINT8_MAX) {
+    LOGE(TAG, "shard(%s): Invalid prefix", prefix ? prefix : "");
+    return false;
+  }
+  if (_begun) {
+    LOGE(TAG, "shard(%s): Must be called before begin()", prefix);
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  _shards.push_back({prefix, name, &storage, nullptr, preload});
+  // keys already configured move to the new shard when it is a better match
+  for (Entry& entry : _entries)
+    entry.shard = static_cast<uint8_t>(_shardOf(entry.key));
+  for (Blob& blob : _blobs)
+    blob.shard = static_cast<uint8_t>(_shardOf(blob.key));
+  LOGD(TAG, "shard(%s): Keys persisted in %s", prefix, name);
+  return true;
+}
+
+size_t Mycila::Config::_shardOf(const char* key, bool exact) const {
+  size_t found = exact ? SIZE_MAX : 0;
+  size_t length = 0;
+  for (size_t i = 0, n = _shards.size(); i < n; i++) {
+    const std::string& prefix = _shards[i].prefix;
+    if (exact ? prefix == key : prefix.size() > length && strncmp(key, prefix.c_str(), prefix.size()) == 0) {
+      found = i + 1;
+      length = prefix.size();
+    }
+  }
+  return found;
+}
+
+void Mycila::Config::preload() {
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    _preload(shard);
+}
+
+bool Mycila::Config::preload(const char* group) {
+  const size_t shard = _shardOf(group, true);
+  if (shard == SIZE_MAX)
+    return false;
+  _preload(shard);
+  return true;
+}
+
+// name of a blob chunk: key.NN
+static bool _isChunkKey(const char* key) {
+  const size_t length = strlen(key);
+  return length > 3 && key[length - 3] == '.' && isdigit(key[length - 2]) && isdigit(key[length - 1]);
+}
+
+void Mycila::Config::_preload(size_t shard) {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  ConfigStorage& storage = _storageAt(shard);
+
+  // list the persisted entries first: the storage is not modified while iterating
+  std::vector<std::pair<std::string, ConfigStorageType>> infos;
+  storage.list([&infos](const char* key, ConfigStorageType type) { infos.emplace_back(key, type); });
+  // sorted by name to find the chunks of a blob
+  std::sort(infos.begin(), infos.end());
+  auto listed = [&infos](const std::string& key) {
+    auto it = std::lower_bound(infos.begin(), infos.end(), key, [](const std::pair<std::string, ConfigStorageType>& info, const std::string& name) { return info.first < name; });
+    return it != infos.end() && it->first == key;
+  };
+
+  std::vector<bool> persisted(_entries.size(), false);
+  size_t removed = 0;
+  // string values are read in one call into a buffer of the max length, instead of reading their length first
+  std::unique_ptr<char[]> buffer;
+
+  for (const auto& info : infos) {
+    const char* key = info.first.c_str();
+    const ConfigKeyId id = keyId(key);
+
+    // blob, or chunk of a blob
+    const Blob* blob = id == CONFIG_KEY_UNKNOWN ? _blob(key, true) : nullptr;
+    if (blob && blob->shard == shard)
+      continue;
+
+    // a blob configured after begin(): its length and its chunks, named key.NN, are kept
+    if (id == CONFIG_KEY_UNKNOWN && (_isChunkKey(key) || listed(info.first + ".00")))
+      continue;
+
+    // orphan entry, or key moved to another shard
+    if (id == CONFIG_KEY_UNKNOWN || _entries[id].shard != shard) {
+      storage.remove(key);
+      STATS_COUNT(nvsRemoves);
+      removed++;
+      LOGD(TAG, "preload(%s): Unknown key removed", key);
+      continue;
+    }
+
+    Entry& entry = _entries[id];
+    persisted[id] = true;
+    if (entry.cached)
+      continue;
+
+    if (info.second == ConfigStorageType::STRING) {
+      if (!buffer)
+        buffer.reset(new char[MYCILA_CONFIG_VALUE_MAX_LENGTH + 1]);
+      size_t size = MYCILA_CONFIG_VALUE_MAX_LENGTH + 1;
+      STATS_COUNT(nvsReads);
+      esp_err_t err = storage.getString(key, buffer.get(), &size);
+      if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+        // longer than the buffer: read again with its length
+        err = _loadString(entry);
+      } else if (err == ESP_OK && size > 1) {
+        _cache(entry, buffer.get(), size - 1);
+      } else if (err == ESP_OK) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+      }
+      if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+        // not assigned to a value
+        storage.remove(key);
+        STATS_COUNT(nvsRemoves);
+        removed++;
+        _cacheDefault(entry);
+        LOGD(TAG, "preload(%s): Key cleaned up", key);
+      }
+      continue;
+    }
+
+    Number number;
+    if (entry.native && _readNative(entry, number)) {
+      _cache(entry, _format(entry.type, number));
+      entry.number = number;
+    }
+  }
+
+  // configured keys not persisted get their default value
+  for (size_t id = 0, n = _entries.size(); id < n; id++)
+    if (!persisted[id] && !_entries[id].cached && _entries[id].shard == shard)
+      _cacheDefault(_entries[id]);
+
+  if (removed)
+    storage.commit();
+  LOGD(TAG, "Preloaded %u entries, removed %u", infos.size() - removed, removed);
+}
+
+bool Mycila::Config::_commitAll() {
+  bool committed = true;
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    committed = _storageAt(shard).commit() && committed;
+  if (!committed)
+    LOGE(TAG, "Commit failed!");
+  return committed;
+}
+
+bool Mycila::Config::_commitEntry(Entry& entry, Op op) {
+  if (_storageOf(entry).commit())
+    return true;
+  // kept dirty: written again by the next flush()
+  LOGE(TAG, "set(%s): Commit failed!", entry.key);
+  entry.dirty = op == Op::SET ? Dirty::PUT : Dirty::REMOVE;
+  return false;
+}
+
+Mycila::ConfigKeyId Mycila::Config::configure(const char* key, const char* defaultValue, ConfigType type, bool native) {
+  return _configure(key, defaultValue ? defaultValue : "", std::string(), type, native);
 }
 
-void Mycila::Config::configure(const char* key, const char* defaultValue) {
-  assert(strlen(key) <= 15);
-  _keys.push_back(key);
-  std::sort(_keys.begin(), _keys.end(), [](const char* a, const char* b) { return strcmp(a, b) < 0; });
-  if (defaultValue)
-    _defaults[key] = defaultValue;
-  else
-    _defaults[key] = empty;
-  LOGD(TAG, "Config Key '%s' defaults to '%s'", key, _defaults[key].c_str());
+Mycila::ConfigKeyId Mycila::Config::configure(const char* key, std::string&& defaultValue, ConfigType type, bool native) {
+  return _configure(key, nullptr, std::move(defaultValue), type, native);
+}
+
+Mycila::ConfigKeyId Mycila::Config::configure(const ConfigKey* schema, size_t count) {
+  // a duplicated key would shift the IDs of the following keys: the table is rejected
+  {
+    std::vector<const char*> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++)
+      names.push_back(schema[i].name);
+    std::sort(names.begin(), names.end(), [](const char* a, const char* b) { return strcmp(a, b) < 0; });
+    for (size_t i = 1; i < count; i++) {
+      if (strcmp(names[i - 1], names[i]) == 0) {
+        LOGE(TAG, "configure(): Duplicate key '%s' in schema!", names[i]);
+        return CONFIG_KEY_UNKNOWN;
+      }
+    }
+  }
+
+  const ConfigKeyId first = _entries.size();
+  // grows geometrically: a schema configured in several calls stays linear
+  if (count > _entries.capacity() - _entries.size())
+    reserve(std::max(_entries.size() + count, 2 * _entries.capacity()));
+
+  // add the new entries without indexing them...
+  for (size_t i = 0; i < count; i++)
+    _configure(schema[i].name, schema[i].defaultValue ? schema[i].defaultValue : "", std::string(), schema[i].type, schema[i].native, false);
+
+  // ...then sort them once and merge them into the index
+  if (_entries.size() > first) {
+    auto cmp = [this](ConfigKeyId a, ConfigKeyId b) { return strcmp(_entries[a].key, _entries[b].key) < 0; };
+    const size_t sorted = _index.size();
+    for (size_t id = first, n = _entries.size(); id < n; id++)
+      _index.push_back(id);
+    std::sort(_index.begin() + sorted, _index.end(), cmp);
+    std::inplace_merge(_index.begin(), _index.begin() + sorted, _index.end(), cmp);
+    _keys.clear();
+    for (ConfigKeyId id : _index) {
+      assert(_keys.empty() || strcmp(_keys.back(), _entries[id].key) != 0);
+      _keys.push_back(_entries[id].key);
+    }
+  }
+
+  return first;
 }
 
-void Mycila::Config::configure(const char* key, std::string&& defaultValue) {
-  assert(strlen(key) <= 15);
-  _keys.push_back(key);
-  std::sort(_keys.begin(), _keys.end(), [](const char* a, const char* b) { return strcmp(a, b) < 0; });
-  _defaults[key] = std::move(defaultValue);
-  LOGD(TAG, "Config Key '%s' defaults to '%s'", key, _defaults[key].c_str());
+void Mycila::Config::reserve(size_t count) {
+  _entries.reserve(count);
+  _keys.reserve(count);
+  _index.reserve(count);
+  std::lock_guard<std::mutex> lock(_subscribersMutex);
+  _dispatch.reserve(count);
 }
 
-const std::string& Mycila::Config::getString(const char* key) const {
-  // check if we have a cached value
-  auto it = _cache.find(key);
-  if (it != _cache.end()) {
-    return it->second;
+Mycila::ConfigKeyId Mycila::Config::_configure(const char* key, const char* defaultValue, std::string&& ownedDefault, ConfigType type, bool native, bool index) {
+  assert(strlen(key) <= MYCILA_CONFIG_KEY_MAX_LENGTH);
+
+  // string literals are in flash: they are referenced instead of being copied
+  if (defaultValue && !_inFlash(defaultValue)) {
+    ownedDefault = defaultValue;
+    defaultValue = nullptr;
+  }
+
+  // key already configured ? => update its default value
+  ConfigKeyId id = keyId(key);
+  if (id != CONFIG_KEY_UNKNOWN) {
+    Entry& entry = _entries[id];
+    entry.defaultValue = defaultValue;
+    entry.ownedDefault = std::move(ownedDefault);
+    entry.type = type;
+    entry.native = native && type != ConfigType::STRING;
+    entry.maybeString = entry.native;
+    if (entry.cached && type != ConfigType::STRING)
+      entry.number = _parse(type, _value(entry));
+    entry.modified = ++_generation;
+    LOGD(TAG, "Config Key '%s' defaults to '%s'", key, _default(entry));
+    return id;
+  }
+
+  assert(_entries.size() < CONFIG_KEY_UNKNOWN);
+  id = _entries.size();
+  if (index) {
+    const size_t pos = std::lower_bound(_keys.begin(), _keys.end(), key, [](const char* a, const char* b) { return strcmp(a, b) < 0; }) - _keys.begin();
+    _keys.insert(_keys.begin() + pos, key);
+    _index.insert(_index.begin() + pos, id);
   }
+  _entries.push_back({key, defaultValue, std::move(ownedDefault), std::string(), nullptr, 0, type, native && type != ConfigType::STRING, false, false, Dirty::CLEAN, {}, 0, 0, static_cast<uint8_t>(_shardOf(key)), native && type != ConfigType::STRING});
+  {
+    std::lock_guard<std::mutex> lock(_subscribersMutex);
+    _dispatch.emplace_back();
+    _dispatchKey(id);
+  }
+  _entries[id].modified = ++_generation;
+  LOGD(TAG, "Config Key '%s' defaults to '%s'", key, _default(_entries[id]));
+  return id;
+}
 
-  // not in cache ? is it a real key ?
-  if (std::find(_keys.begin(), _keys.end(), key) == _keys.end()) {
+Mycila::ConfigKeyId Mycila::Config::_lookup(const char* key) const {
+  const ConfigKeyId id = keyId(key);
+  if (id == CONFIG_KEY_UNKNOWN)
     LOGW(TAG, "get(%s): Key unknown", key);
+  return id;
+}
+
+// reads an entry with the shared lock when the value is cached, otherwise loads it with the exclusive lock
+template <typename F>
+auto Mycila::Config::_read(Entry& entry, F&& reader) const {
+  // check if we have a cached value: readers do not block each other
+  {
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    if (entry.cached) {
+      STATS_COUNT(cacheHits);
+      _touch(entry);
+      return reader(entry);
+    }
+  }
+
+  // not in cache: load it exclusively
+  STATS_COUNT(cacheMisses);
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  _load(entry);
+  return reader(entry);
+}
+
+const char* Mycila::Config::get(const char* key) const {
+  const ConfigKeyId id = _lookup(key);
+  return id == CONFIG_KEY_UNKNOWN ? "" : get(id);
+}
+
+const char* Mycila::Config::get(std::string_view key) const {
+  const ConfigKeyId id = keyId(key);
+  if (id == CONFIG_KEY_UNKNOWN) {
+    LOGW(TAG, "get(%.*s): Key unknown", static_cast<int>(key.size()), key.data());
+    return "";
+  }
+  return get(id);
+}
+
+const char* Mycila::Config::get(ConfigKeyId id) const {
+  STATS_TIME(*this, get);
+  if (id >= _entries.size()) {
+    LOGW(TAG, "get(%" PRIu16 "): Key unknown", id);
+    return "";
+  }
+  return _read(_entries[id], [](const Entry& entry) { return _value(entry); });
+}
+
+std::string Mycila::Config::getString(ConfigKeyId id) const {
+  STATS_TIME(*this, get);
+  if (id >= _entries.size()) {
+    LOGW(TAG, "get(%" PRIu16 "): Key unknown", id);
     return empty;
   }
+  // copied while locked
+  return _read(_entries[id], [](const Entry& entry) { return std::string(_value(entry)); });
+}
 
-  // real key exists ?
-  if (_prefs.isKey(key)) {
-    const std::string value = _prefs.getString(key).c_str();
+bool Mycila::Config::isEmpty(const char* key) const {
+  const ConfigKeyId id = _lookup(key);
+  return id == CONFIG_KEY_UNKNOWN || isEmpty(id);
+}
 
-    // key exist and is assigned to a value ?
-    if (!value.empty()) {
-      _cache[key] = value;
-      LOGD(TAG, "get(%s): Key cached", key);
-      return _cache[key];
-    }
+bool Mycila::Config::isEqual(const char* key, const char* value) const {
+  const ConfigKeyId id = _lookup(key);
+  return id == CONFIG_KEY_UNKNOWN ? value[0] == '\0' : isEqual(id, value);
+}
+
+bool Mycila::Config::isEmpty(ConfigKeyId id) const {
+  STATS_TIME(*this, get);
+  if (id >= _entries.size()) {
+    LOGW(TAG, "get(%" PRIu16 "): Key unknown", id);
+    return true;
+  }
+  return _read(_entries[id], [](const Entry& entry) { return _value(entry)[0] == '\0'; });
+}
+
+bool Mycila::Config::isEqual(ConfigKeyId id, const char* value) const {
+  STATS_TIME(*this, get);
+  if (id >= _entries.size()) {
+    LOGW(TAG, "get(%" PRIu16 "): Key unknown", id);
+    return value[0] == '\0';
+  }
+  return _read(_entries[id], [value](const Entry& entry) { return strcmp(_value(entry), value) == 0; });
+}
+
+void Mycila::Config::_load(Entry& entry) const {
+  // loaded by another task in the meantime ?
+  if (entry.cached)
+    return;
+
+  // typed key persisted natively ?
+  const char* key = entry.key;
+  Number number;
+  if (entry.native && _readNative(entry, number)) {
+    _cache(entry, _format(entry.type, number));
+    entry.number = number;
+    LOGD(TAG, "get(%s): Key cached", key);
+    return;
+  }
+
+  // key exist and is assigned to a value ?
+  const esp_err_t err = _loadString(entry);
+  if (err == ESP_OK) {
+    LOGD(TAG, "get(%s): Key cached", key);
+    return;
+  }
 
-    // key exist but is not assigned to a value => remove it
-    _prefs.remove(key);
+  // key exist but is not assigned to a value => remove it
+  if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+    _storageOf(entry).remove(key);
+    STATS_COUNT(nvsRemoves);
     LOGD(TAG, "get(%s): Key cleaned up", key);
   }
 
   // key does not exist, or not assigned to a value
-  _cache[key] = _defaults[key];
-  return _cache[key];
+  _cacheDefault(entry);
+}
+
+void Mycila::Config::_touch(Entry& entry) const {
+  // several readers can touch the same entry concurrently
+  if (_cachePolicy == ConfigCachePolicy::LRU)
+    __atomic_store_n(&entry.lastUse, ++_tick, __ATOMIC_RELAXED);
 }
 
 bool Mycila::Config::getBool(const char* key) const {
-  const std::string& val = get(key);
-  return val == "true" || val == "1" || val == "on" || val == "yes";
+  const ConfigKeyId id = _lookup(key);
+  return id != CONFIG_KEY_UNKNOWN && getBool(id);
+}
+
+long Mycila::Config::getLong(const char* key) const { // NOLINT
+  const ConfigKeyId id = _lookup(key);
+  return id == CONFIG_KEY_UNKNOWN ? 0 : getLong(id);
+}
+
+float Mycila::Config::getFloat(const char* key) const {
+  const ConfigKeyId id = _lookup(key);
+  return id == CONFIG_KEY_UNKNOWN ? 0 : getFloat(id);
+}
+
+bool Mycila::Config::getBool(ConfigKeyId id) const { return _number(id, ConfigType::BOOL).b; }
+
+long Mycila::Config::getLong(ConfigKeyId id) const { return _number(id, ConfigType::LONG).l; } // NOLINT
+
+float Mycila::Config::getFloat(ConfigKeyId id) const { return _number(id, ConfigType::FLOAT).f; }
+
+Mycila::Config::Number Mycila::Config::_number(ConfigKeyId id, ConfigType type) const {
+  STATS_TIME(*this, get);
+  if (id >= _entries.size()) {
+    LOGW(TAG, "get(%" PRIu16 "): Key unknown", id);
+    return _parse(type, "");
+  }
+
+  return _read(_entries[id], [type](const Entry& entry) { return _number(entry, type); });
+}
+
+Mycila::Config::Number Mycila::Config::_number(const Entry& entry, ConfigType type) {
+  // INT and LONG share the same representation
+  const ConfigType family = entry.type == ConfigType::INT ? ConfigType::LONG : entry.type;
+  return family == type ? entry.number : _parse(type, _value(entry));
+}
+
+Mycila::Config::Number Mycila::Config::_parse(ConfigType type, const char* value) {
+  Number number;
+  switch (type) {
+    case ConfigType::BOOL:
+      number.b = strcmp(value, "true") == 0 || strcmp(value, "1") == 0 || strcmp(value, "on") == 0 || strcmp(value, "yes") == 0;
+      break;
+    case ConfigType::FLOAT:
+      number.f = strtof(value, nullptr);
+      break;
+    default:
+      number.l = strtol(value, nullptr, 10);
+      break;
+  }
+  return number;
+}
+
+std::string Mycila::Config::_format(ConfigType type, const Number& number) {
+  switch (type) {
+    case ConfigType::BOOL:
+      return number.b ? "true" : "false";
+    case ConfigType::FLOAT: {
+      // 9 significant digits: the shortest precision which round-trips any float
+      char buffer[24];
+      snprintf(buffer, sizeof(buffer), "%.9g", number.f);
+      return buffer;
+    }
+    default:
+      return std::to_string(number.l);
+  }
+}
+
+bool Mycila::Config::_readNative(const Entry& entry, Number& number) const {
+  STATS_COUNT(nvsReads);
+  switch (entry.type) {
+    case ConfigType::BOOL:
+      return _storageOf(entry).getBool(entry.key, number.b);
+    case ConfigType::INT:
+    case ConfigType::LONG:
+      return _storageOf(entry).getLong(entry.key, number.l);
+    case ConfigType::FLOAT:
+      return _storageOf(entry).getFloat(entry.key, number.f);
+    default:
+      return false;
+  }
+}
+
+bool Mycila::Config::_persistedEquals(const Entry& entry, const char* value) const {
+  // pending value not yet persisted, or value already cached: no need to read NVS
+  const bool cached = entry.dirty == Dirty::PUT || (entry.cached && !entry.isDefault);
+
+  if (entry.native) {
+    Number persisted = entry.number;
+    // the key might still be persisted as a string
+    if (!cached && !_readNative(entry, persisted))
+      return false;
+    const Number number = _parse(entry.type, value);
+    switch (entry.type) {
+      case ConfigType::BOOL:
+        return number.b == persisted.b;
+      case ConfigType::FLOAT:
+        return number.f == persisted.f;
+      default:
+        return number.l == persisted.l;
+    }
+  }
+
+  if (cached)
+    return strcmp(_value(entry), value) == 0;
+
+  // compare the lengths first, then read the persisted value on the stack when it is short
+  const size_t length = strlen(value) + 1;
+  size_t size = 0;
+  STATS_COUNT(nvsReads);
+  if (_storageOf(entry).getString(entry.key, nullptr, &size) != ESP_OK || size != length)
+    return false;
+  char stack[64];
+  std::unique_ptr<char[]> heap(size > sizeof(stack) ? new char[size] : nullptr);
+  char* buffer = heap ? heap.get() : stack;
+  return _storageOf(entry).getString(entry.key, buffer, &size) == ESP_OK && memcmp(buffer, value, length) == 0;
+}
+
+bool Mycila::Config::_put(Entry& entry, const char* value) {
+  if (!entry.native)
+    return _written(_storageOf(entry).putString(entry.key, value));
+
+  // a value persisted as a string before the key became native is replaced
+  if (entry.maybeString) {
+    if (_storageOf(entry).type(entry.key) == ConfigStorageType::STRING) {
+      _storageOf(entry).remove(entry.key);
+      STATS_COUNT(nvsRemoves);
+    }
+    entry.maybeString = false;
+  }
+
+  const Number number = _parse(entry.type, value);
+  switch (entry.type) {
+    case ConfigType::BOOL:
+      return _written(_storageOf(entry).putBool(entry.key, number.b));
+    case ConfigType::FLOAT:
+      return _written(_storageOf(entry).putFloat(entry.key, number.f));
+    default:
+      return _written(_storageOf(entry).putLong(entry.key, number.l));
+  }
+}
+
+bool Mycila::Config::_written(size_t bytes) {
+  if (!bytes)
+    return false;
+  STATS_COUNT(nvsWrites);
+  STATS_ADD(bytesPersisted, bytes);
+  return true;
 }
 
 bool Mycila::Config::set(const char* key, const char* value, bool fireChangeCallback) {
-  Op op = _set(key, value, fireChangeCallback);
-  if (op == Op::SET) {
-    _cache[key] = value;
-    LOGD(TAG, "set(%s, %s)", key, value);
-    if (fireChangeCallback && _changeCallback)
-      _changeCallback(key, _cache[key]);
-    return true;
+  const ConfigKeyId id = keyId(key);
+  if (id == CONFIG_KEY_UNKNOWN) {
+    if (value == nullptr || !value[0]) {
+      LOGW(TAG, "unset(%s): Unknown key!", key);
+    } else {
+      LOGW(TAG, "set(%s, %s): Unknown key!", key, value);
+    }
+    return false;
   }
-  return op == Op::UNSET;
+  return set(id, value, fireChangeCallback);
 }
 
 bool Mycila::Config::set(const char* key, const std::string&& value, bool fireChangeCallback) {
-  Op op = _set(key, value.c_str(), fireChangeCallback);
-  if (op == Op::SET) {
-    _cache[key] = std::move(value);
-    LOGD(TAG, "set(%s, %s)", key, value.c_str());
-    if (fireChangeCallback && _changeCallback)
-      _changeCallback(key, _cache[key]);
-    return true;
+  const ConfigKeyId id = keyId(key);
+  if (id == CONFIG_KEY_UNKNOWN) {
+    LOGW(TAG, "set(%s, %s): Unknown key!", key, value.c_str());
+    return false;
+  }
+  return set(id, std::move(value), fireChangeCallback);
+}
+
+bool Mycila::Config::set(ConfigKeyId id, const char* value, bool fireChangeCallback) {
+  STATS_TIME(*this, set);
+  // the cache and the callbacks get the value as it is read back from NVS
+  std::string normalized;
+  if (id < _entries.size() && _entries[id].native && value && value[0]) {
+    normalized = _normalize(_entries[id], value);
+    value = normalized.c_str();
+  }
+  Op op;
+  bool committed = true;
+  {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    op = _set(id, value);
+    if (op == Op::SET) {
+      Entry& entry = _entries[id];
+      _cache(entry, value, strlen(value));
+      LOGD(TAG, "set(%s, %s)", entry.key, value);
+    }
+    if (op != Op::NOOP) {
+      _entries[id].modified = ++_generation;
+      committed = _commitEntry(_entries[id], op);
+    }
+  }
+  if (!committed)
+    return false;
+  if (op != Op::NOOP && fireChangeCallback && _listened(id))
+    _changed(id, op == Op::SET ? std::string(value) : empty);
+  return op != Op::NOOP;
+}
+
+bool Mycila::Config::set(ConfigKeyId id, const std::string&& value, bool fireChangeCallback) {
+  if (id < _entries.size() && _entries[id].native)
+    return set(id, value.c_str(), fireChangeCallback);
+  STATS_TIME(*this, set);
+  Op op;
+  bool committed = true;
+  {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    op = _set(id, value.c_str());
+    if (op == Op::SET) {
+      Entry& entry = _entries[id];
+      _cache(entry, value.c_str(), value.size());
+      LOGD(TAG, "set(%s, %s)", entry.key, _value(entry));
+    }
+    if (op != Op::NOOP) {
+      _entries[id].modified = ++_generation;
+      committed = _commitEntry(_entries[id], op);
+    }
   }
-  return op == Op::UNSET;
+  if (!committed)
+    return false;
+  if (op != Op::NOOP && fireChangeCallback && _listened(id))
+    _changed(id, op == Op::SET ? value : empty);
+  return op != Op::NOOP;
 }
 
-Mycila::Config::Op Mycila::Config::_set(const char* key, const char* value, bool fireChangeCallback) {
+Mycila::Config::Op Mycila::Config::_set(ConfigKeyId id, const char* value) {
   const bool del = value == nullptr || !value[0];
 
   // check if the key is valid
-  if (std::find(_keys.begin(), _keys.end(), key) == _keys.end()) {
+  if (id >= _entries.size()) {
     if (del) {
-      LOGW(TAG, "unset(%s): Unknown key!", key);
+      LOGW(TAG, "unset(%" PRIu16 "): Unknown key!", id);
     } else {
-      LOGW(TAG, "set(%s, %s): Unknown key!", key, value);
+      LOGW(TAG, "set(%" PRIu16 ", %s): Unknown key!", id, value);
     }
     return Op::NOOP;
   }
 
+  Entry& entry = _entries[id];
+  const char* key = entry.key;
+  const bool keyPersisted = _isPersisted(entry);
+
   // requested deletion ?
   if (del) {
-    // key not there or not removed
-    if (!_prefs.isKey(key) || !_prefs.remove(key))
+    // key not there
+    if (!keyPersisted)
       return Op::NOOP;
 
-    // key there and to remove
-    _cache.erase(key);
+    if (_writeBehindDelay) {
+      // removal deferred until the next flush
+      entry.dirty = Dirty::REMOVE;
+      _scheduleFlush();
+    } else {
+      // key not removed
+      if (!_storageOf(entry).remove(key))
+        return Op::NOOP;
+      STATS_COUNT(nvsRemoves);
+    }
+
+    // key there and removed: the value is now the default one
+    _cacheDefault(entry);
     LOGD(TAG, "unset(%s)", key);
-    if (fireChangeCallback && _changeCallback)
-      _changeCallback(key, empty);
     return Op::UNSET;
   }
 
-  const bool keyPersisted = _prefs.isKey(key);
-
   // key there and set to value
-  if (keyPersisted && strcmp(value, _prefs.getString(key).c_str()) == 0)
+  if (keyPersisted && _persistedEquals(entry, value))
     return Op::NOOP;
 
   // key not there and set to default value
-  if (!keyPersisted && _defaults[key] == value)
+  if (!keyPersisted && strcmp(_default(entry), value) == 0)
     return Op::NOOP;
 
+  if (_writeBehindDelay) {
+    // write deferred until the next flush
+    entry.dirty = Dirty::PUT;
+    _scheduleFlush();
+    return Op::SET;
+  }
+
   // update failed ?
-  if (!_prefs.putString(key, value))
+  if (!_put(entry, value))
     return Op::NOOP;
 
   // to update
   return Op::SET;
 }
 
+bool Mycila::Config::_isPersisted(const Entry& entry) const {
+  switch (entry.dirty) {
+    case Dirty::PUT:
+      return true;
+    case Dirty::REMOVE:
+      return false;
+    default:
+      // the cache knows whether the key is persisted
+      if (entry.cached)
+        return !entry.isDefault;
+      STATS_COUNT(nvsReads);
+      return _storageOf(entry).isKey(entry.key);
+  }
+}
+
+void Mycila::Config::setWriteBehind(uint32_t delayMs) {
+  TimerHandle_t timer;
+  {
+    // the mode is switched before flushing: a concurrent set() cannot stay pending without a timer
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    _writeBehindDelay = delayMs;
+    timer = _flushTimer;
+    _flushTimer = nullptr;
+    _flush();
+  }
+  // deleted unlocked: a running flush callback waits for the lock
+  if (timer)
+    _deleteTimer(timer);
+}
+
+// deletes a timer once the timer task cannot be running its callback anymore
+void Mycila::Config::_deleteTimer(TimerHandle_t timer) {
+  xTimerStop(timer, portMAX_DELAY);
+  xTimerDelete(timer, portMAX_DELAY);
+  // called from a timer callback: no other callback is running
+  if (xTaskGetCurrentTaskHandle() == xTimerGetTimerDaemonTaskHandle())
+    return;
+  // the timer task runs the pended call after the delete command and after the running callback
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  if (!done)
+    return;
+  if (xTimerPendFunctionCall([](void* done, uint32_t) { xSemaphoreGive(static_cast<SemaphoreHandle_t>(done)); }, done, 0, portMAX_DELAY) == pdPASS)
+    xSemaphoreTake(done, portMAX_DELAY);
+  vSemaphoreDelete(done);
+}
+
+size_t Mycila::Config::flush() {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  return _flush();
+}
+
+size_t Mycila::Config::_flush() {
+  // marked clean once committed
+  std::vector<Entry*> flushed;
+  for (Entry& entry : _entries) {
+    switch (entry.dirty) {
+      case Dirty::PUT:
+        if (!_put(entry, _value(entry))) {
+          LOGE(TAG, "flush(%s): Write failed!", entry.key);
+          continue;
+        }
+        break;
+      case Dirty::REMOVE:
+        // the key might not have been persisted yet
+        if (_storageOf(entry).isKey(entry.key) && !_storageOf(entry).remove(entry.key)) {
+          LOGE(TAG, "flush(%s): Remove failed!", entry.key);
+          continue;
+        }
+        STATS_COUNT(nvsRemoves);
+        break;
+      default:
+        continue;
+    }
+    flushed.push_back(&entry);
+  }
+  if (flushed.empty() || !_commitAll())
+    return 0;
+  for (Entry* entry : flushed)
+    entry->dirty = Dirty::CLEAN;
+  LOGD(TAG, "Flushed %u keys", flushed.size());
+  // flushed values can now be evicted
+  _evict(nullptr);
+  return flushed.size();
+}
+
+void Mycila::Config::_scheduleFlush() {
+  if (!_flushTimer) {
+    _flushTimer = xTimerCreate("mycila_config", pdMS_TO_TICKS(_writeBehindDelay), pdFALSE, this, [](TimerHandle_t timer) {
+      static_cast<Config*>(pvTimerGetTimerID(timer))->flush();
+    });
+    if (!_flushTimer) {
+      LOGE(TAG, "Unable to create flush timer!");
+      return;
+    }
+  }
+  // the delay starts at the first pending change and is not pushed back by the following ones
+  if (xTimerIsTimerActive(_flushTimer) == pdFALSE)
+    xTimerStart(_flushTimer, 0);
+}
+
 bool Mycila::Config::set(const std::map<const char*, std::string>& settings, bool fireChangeCallback) {
-  bool updates = false;
-  // start restoring settings
-  for (auto& key : _keys)
-    if (!isEnableKey(key) && settings.find(key) != settings.end())
-      updates |= set(key, settings.at(key).c_str(), fireChangeCallback);
-  // then restore settings enabling/disabling a feature
-  for (auto& key : _keys)
-    if (isEnableKey(key) && settings.find(key) != settings.end())
-      updates |= set(key, settings.at(key).c_str(), fireChangeCallback);
-  return updates;
+  Transaction transaction = beginTransaction();
+  for (auto& setting : settings)
+    if (keyId(setting.first) != CONFIG_KEY_UNKNOWN)
+      transaction.set(setting.first, setting.second);
+  return transaction.commit(fireChangeCallback);
 }
 
-void Mycila::Config::backup(Print& out) {
-  for (auto& key : _keys) {
-    out.print(key);
-    out.print('=');
-    out.print(get(key));
-    out.print("\n");
-  }
-}
-
-bool Mycila::Config::restore(const char* data) {
-  std::map<const char*, std::string> settings;
-  for (auto& key : _keys) {
-    // int start = data.indexOf(key);
-    char* start = strstr(data, key);
-    if (start) {
-      start += strlen(key);
-      if (*start != '=')
+bool Mycila::Config::_commit(std::vector<std::pair<ConfigKeyId, std::string>>& changes, bool fireChangeCallback) {
+  // start with the settings, then the settings enabling/disabling a feature.
+  // the sort is stable so that the last staged value of a key comes last.
+  std::stable_sort(changes.begin(), changes.end(), [this](const std::pair<ConfigKeyId, std::string>& a, const std::pair<ConfigKeyId, std::string>& b) {
+    const char* keyA = _entries[a.first].key;
+    const char* keyB = _entries[b.first].key;
+    const bool enableA = isEnableKey(keyA);
+    const bool enableB = isEnableKey(keyB);
+    if (enableA != enableB)
+      return enableB;
+    return strcmp(keyA, keyB) < 0;
+  });
+
+  // indexes of the applied changes
+  std::vector<std::pair<size_t, Op>> applied;
+  applied.reserve(changes.size());
+
+  {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    for (size_t i = 0, n = changes.size(); i < n; i++) {
+      // skip the values overridden later in the same transaction
+      if (i + 1 < n && changes[i + 1].first == changes[i].first)
         continue;
-      start++;
-      char* end = strchr(start, '\r');
-      if (!end)
-        end = strchr(start, '\n');
-      if (!end) {
-        LOGW(TAG, "restore(%s): Invalid data!", key);
+      const ConfigKeyId id = changes[i].first;
+      const Op op = _set(id, changes[i].second.c_str());
+      if (op == Op::SET) {
+        Entry& entry = _entries[id];
+        _cache(entry, changes[i].second.c_str(), changes[i].second.size());
+        LOGD(TAG, "set(%s, %s)", entry.key, _value(entry));
+      }
+      if (op != Op::NOOP)
+        applied.emplace_back(i, op);
+    }
+    if (!applied.empty()) {
+      _generation++;
+      for (auto& change : applied)
+        _entries[changes[change.first].first].modified = _generation;
+      // a single commit for the whole transaction
+      if (!_commitAll()) {
+        // kept dirty: written again by the next flush()
+        for (auto& change : applied)
+          _entries[changes[change.first].first].dirty = change.second == Op::SET ? Dirty::PUT : Dirty::REMOVE;
+        changes.clear();
         return false;
       }
-      settings[key] = std::string(start, end - start);
     }
   }
-  return restore(settings);
+
+  // the staged values are used for the callbacks: the cache could be changed concurrently
+  if (fireChangeCallback)
+    for (auto& change : applied)
+      if (_listened(changes[change.first].first))
+        _changed(changes[change.first].first, change.second == Op::SET ? changes[change.first].second : empty);
+
+  const bool updated = !applied.empty();
+  changes.clear();
+  return updated;
 }
 
-bool Mycila::Config::restore(const std::map<const char*, std::string>& settings) {
-  LOGD(TAG, "Restoring %d settings...", settings.size());
-  bool restored = set(settings, false);
-  if (restored) {
-    LOGD(TAG, "Config restored");
-    if (_restoreCallback)
-      _restoreCallback();
-  } else
-    LOGD(TAG, "No change detected");
-  return restored;
+Mycila::ConfigSubscriptionId Mycila::Config::_subscribe(const char* match, bool prefix, ConfigChangeCallback callback, std::shared_ptr<Batch> batch) {
+  std::lock_guard<std::mutex> lock(_subscribersMutex);
+  assert(_subscribers.size() < UINT16_MAX);
+  std::shared_ptr<const ConfigChangeCallback> shared = callback ? std::make_shared<const ConfigChangeCallback>(std::move(callback)) : nullptr;
+  _subscribers.push_back({++_lastSubscription, match ? match : "", prefix, std::move(shared), std::move(batch)});
+  for (size_t id = 0, n = _entries.size(); id < n; id++)
+    _dispatchKey(id);
+  return _lastSubscription;
 }
 
-void Mycila::Config::clear() {
-  _prefs.clear();
-  _cache.clear();
+bool Mycila::Config::unsubscribe(ConfigSubscriptionId subscription) {
+  std::shared_ptr<Batch> batch;
+  {
+    std::lock_guard<std::mutex> lock(_subscribersMutex);
+    auto it = std::find_if(_subscribers.begin(), _subscribers.end(), [subscription](const Subscriber& subscriber) { return subscriber.id == subscription; });
+    if (it == _subscribers.end())
+      return false;
+    batch = std::move(it->batch);
+    _subscribers.erase(it);
+    for (size_t id = 0, n = _entries.size(); id < n; id++)
+      _dispatchKey(id);
+  }
+  if (batch)
+    _deleteBatch(std::move(batch));
+  return true;
 }
 
-bool Mycila::Config::isPasswordKey(const char* key) const {
-  uint32_t len = strlen(key);
-  if (len < 4)
-    return false;
-  return strcmp(key + len - 4, MYCILA_CONFIG_KEY_PASSWORD_SUFFIX) == 0;
+void Mycila::Config::_dispatchKey(ConfigKeyId id) {
+  const char* key = _entries[id].key;
+  std::vector<uint16_t>& dispatch = _dispatch[id];
+  dispatch.clear();
+  for (size_t i = 0, n = _subscribers.size(); i < n; i++) {
+    const Subscriber& subscriber = _subscribers[i];
+    const bool match = subscriber.prefix ? strncmp(key, subscriber.match.c_str(), subscriber.match.size()) == 0 : subscriber.match == key;
+    if (match)
+      dispatch.push_back(i);
+  }
 }
 
-bool Mycila::Config::isEnableKey(const char* key) const {
-  uint32_t len = strlen(key);
-  if (len < 7)
-    return false;
-  return strcmp(key + len - 7, MYCILA_CONFIG_KEY_ENABLE_SUFFIX) == 0;
+bool Mycila::Config::_listened(ConfigKeyId id) const {
+  if (_changeCallback)
+    return true;
+  std::lock_guard<std::mutex> lock(_subscribersMutex);
+  return !_dispatch[id].empty();
 }
 
-const char* Mycila::Config::keyRef(const char* buffer) const {
-  for (auto& k : _keys)
-    if (strcmp(k, buffer) == 0)
-      return k;
-  return nullptr;
+void Mycila::Config::_notify(ConfigKeyId id, const std::string& value) const {
+  const char* key = _entries[id].key;
+  if (_changeCallback) {
+    STATS_TIME(*this, callbacks);
+    _changeCallback(key, value);
+  }
+
+  // the subscribers are copied: callbacks can subscribe and unsubscribe
+  std::vector<std::pair<std::shared_ptr<const ConfigChangeCallback>, std::shared_ptr<Batch>>> subscribers;
+  {
+    std::lock_guard<std::mutex> lock(_subscribersMutex);
+    subscribers.reserve(_dispatch[id].size());
+    for (uint16_t i : _dispatch[id])
+      subscribers.emplace_back(_subscribers[i].callback, _subscribers[i].batch);
+  }
+  for (const auto& subscriber : subscribers) {
+    if (subscriber.second) {
+      _batchChanged(*subscriber.second, id);
+    } else {
+      STATS_TIME(*this, callbacks);
+      (*subscriber.first)(key, value);
+    }
+  }
 }
 
-#ifdef MYCILA_JSON_SUPPORT
-void Mycila::Config::toJson(const JsonObject& root) {
-  for (auto& key : _keys) {
-    const std::string& value = get(key);
+Mycila::ConfigSubscriptionId Mycila::Config::subscribeBatch(const char* prefix, uint32_t windowMs, ConfigBatchCallback callback) {
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  batch->callback = std::move(callback);
+#ifdef MYCILA_CONFIG_STATS
+  batch->config = this;
+#endif
+  batch->timer = xTimerCreate("mycila_batch", pdMS_TO_TICKS(windowMs ? windowMs : 1), pdFALSE, batch.get(), _batchTimer);
+  if (!batch->timer) {
+    LOGE(TAG, "Unable to create batch timer!");
+    return 0;
+  }
+  return _subscribe(prefix, true, nullptr, std::move(batch));
+}
+
+void Mycila::Config::_batchChanged(Batch& batch, ConfigKeyId id) {
+  std::lock_guard<std::mutex> lock(batch.mutex);
+  if (batch.stopped)
+    return;
+  // the window starts at the first change and is not pushed back by the following ones
+  if (!batch.armed) {
+    // the timer command queue can be full: retry with a short wait, except from the timer task which drains it
+    batch.armed = xTimerStart(batch.timer, 0) == pdPASS ||
+                  (xTaskGetCurrentTaskHandle() != xTimerGetTimerDaemonTaskHandle() && xTimerStart(batch.timer, pdMS_TO_TICKS(10)) == pdPASS);
+    if (!batch.armed)
+      LOGW(TAG, "Unable to start batch timer: the change is delivered with the next one");
+  }
+  auto it = std::lower_bound(batch.pending.begin(), batch.pending.end(), id);
+  if (it == batch.pending.end() || *it != id)
+    batch.pending.insert(it, id);
+}
+
+void Mycila::Config::_batchTimer(TimerHandle_t timer) {
+  Batch& batch = *static_cast<Batch*>(pvTimerGetTimerID(timer));
+  std::vector<ConfigKeyId> keys;
+  {
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    keys.swap(batch.pending);
+    batch.armed = false;
+  }
+  if (!keys.empty()) {
+    STATS_TIME(*batch.config, callbacks);
+    batch.callback(keys);
+  }
+}
+
+void Mycila::Config::_deleteBatch(std::shared_ptr<Batch> batch) {
+  // a notification still holding the batch does not start the timer anymore
+  {
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    batch->stopped = true;
+  }
+  xTimerStop(batch->timer, portMAX_DELAY);
+  xTimerDelete(batch->timer, portMAX_DELAY);
+  // the timer task might be running the callback: the batch is released by the timer task, after the timer is deleted
+  std::shared_ptr<Batch>* pending = new std::shared_ptr<Batch>(std::move(batch));
+  if (xTimerPendFunctionCall([](void* batch, uint32_t) { delete static_cast<std::shared_ptr<Batch>*>(batch); }, pending, 0, portMAX_DELAY) != pdPASS)
+    delete pending;
+}
+
+bool Mycila::Config::setAsyncDispatch(size_t queueLength, ConfigDispatchOverflow overflow, uint32_t stackSize, UBaseType_t priority) {
+  // the dispatch task would wait for itself to stop
+  if (_dispatchTask && xTaskGetCurrentTaskHandle() == _dispatchTask) {
+    LOGE(TAG, "setAsyncDispatch(): Cannot be called from a callback of the dispatch task!");
+    return false;
+  }
+
+  // stop the current task once the queued events are delivered
+  if (_dispatchTask) {
+    {
+      // waits for the tasks queuing an event: the dispatch task keeps emptying the queue for the ones blocked on a full queue
+      std::unique_lock<std::shared_mutex> lock(_dispatchMutex);
+      _dispatchOpen = false;
+    }
+    // nothing is queued after the stop
+    const Event stop = {Event::Type::STOP, CONFIG_KEY_UNKNOWN, nullptr};
+    xQueueSend(_dispatchQueue, &stop, portMAX_DELAY);
+    xSemaphoreTake(_dispatchStopped, portMAX_DELAY);
+    _dispatchTask = nullptr;
+  }
+  if (_dispatchQueue) {
+    vQueueDelete(_dispatchQueue);
+    _dispatchQueue = nullptr;
+  }
+  if (_dispatchStopped) {
+    vSemaphoreDelete(_dispatchStopped);
+    _dispatchStopped = nullptr;
+  }
+
+  if (!queueLength)
+    return true;
+
+  _dispatchQueue = xQueueCreate(queueLength, sizeof(Event));
+  _dispatchStopped = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  if (!_dispatchQueue || !_dispatchStopped || xTaskCreate(_dispatchLoop, "mycila_config", stackSize, this, priority, &task) != pdPASS) {
+    LOGE(TAG, "Unable to start the dispatch task");
+    setAsyncDispatch(0);
+    return false;
+  }
+  _dispatchTask = task;
+  std::unique_lock<std::shared_mutex> lock(_dispatchMutex);
+  _dispatchOverflow = overflow;
+  _dispatchOpen = true;
+  return true;
+}
+
+void Mycila::Config::_changed(ConfigKeyId id, const std::string& value) {
+  // callbacks calling set() from the dispatch task must not wait for the queue they empty
+  if (xTaskGetCurrentTaskHandle() != _dispatchTask) {
+    std::shared_lock<std::shared_mutex> lock(_dispatchMutex);
+    if (_dispatchOpen) {
+      _enqueue({Event::Type::CHANGE, id, new std::string(value)});
+      return;
+    }
+  }
+  _notify(id, value);
+}
+
+void Mycila::Config::_restored() {
+  if (!_restoreCallback)
+    return;
+  if (xTaskGetCurrentTaskHandle() != _dispatchTask) {
+    std::shared_lock<std::shared_mutex> lock(_dispatchMutex);
+    if (_dispatchOpen) {
+      _enqueue({Event::Type::RESTORE, CONFIG_KEY_UNKNOWN, nullptr});
+      return;
+    }
+  }
+  STATS_TIME(*this, callbacks);
+  _restoreCallback();
+}
+
+void Mycila::Config::_enqueue(const Event& event) {
+  switch (_dispatchOverflow) {
+    case ConfigDispatchOverflow::BLOCK:
+      xQueueSend(_dispatchQueue, &event, portMAX_DELAY);
+      return;
+    case ConfigDispatchOverflow::DROP_OLDEST: {
+      Event dropped;
+      while (xQueueSend(_dispatchQueue, &event, 0) != pdTRUE) {
+        if (xQueueReceive(_dispatchQueue, &dropped, 0) != pdTRUE)
+          continue;
+        delete dropped.value;
+        _droppedEvents++;
+      }
+      return;
+    }
+    default:
+      if (xQueueSend(_dispatchQueue, &event, 0) != pdTRUE) {
+        delete event.value;
+        _droppedEvents++;
+      }
+      return;
+  }
+}
+
+void Mycila::Config::_dispatchLoop(void* params) {
+  Config* config = reinterpret_cast<Config*>(params);
+  Event event;
+  while (xQueueReceive(config->_dispatchQueue, &event, portMAX_DELAY) == pdTRUE) {
+    if (event.type == Event::Type::STOP)
+      break;
+    if (event.type == Event::Type::RESTORE) {
+      if (config->_restoreCallback) {
+        STATS_TIME(*config, callbacks);
+        config->_restoreCallback();
+      }
+    } else {
+      config->_notify(event.id, *event.value);
+      delete event.value;
+    }
+  }
+  xSemaphoreGive(config->_dispatchStopped);
+  vTaskDelete(NULL);
+}
+
+bool Mycila::Config::Transaction::set(const char* key, const char* value) {
+  return set(key, std::string(value ? value : ""));
+}
+
+bool Mycila::Config::Transaction::set(const char* key, std::string value) {
+  const ConfigKeyId id = _config->keyId(key);
+  if (id == CONFIG_KEY_UNKNOWN) {
+    LOGW(TAG, "set(%s, %s): Unknown key!", key, value.c_str());
+    return false;
+  }
+  return set(id, std::move(value));
+}
+
+bool Mycila::Config::Transaction::set(ConfigKeyId id, std::string value) {
+  if (id >= _config->_entries.size()) {
+    LOGW(TAG, "set(%" PRIu16 ", %s): Unknown key!", id, value.c_str());
+    return false;
+  }
+  const Entry& entry = _config->_entries[id];
+  if (entry.native && !value.empty())
+    value = _normalize(entry, value.c_str());
+  _changes.emplace_back(id, std::move(value));
+  return true;
+}
+
+bool Mycila::Config::Transaction::commit(bool fireChangeCallback) {
+  return _config->_commit(_changes, fireChangeCallback);
+}
+
+void Mycila::Config::backup(Print& out) {
+  STATS_TIME(*this, backup);
+  Backup backup = beginBackup();
+  uint8_t buffer[128];
+  size_t length;
+  while ((length = backup.read(buffer, sizeof(buffer))) > 0)
+    out.write(buffer, length);
+}
+
+void Mycila::Config::backup(Print& out, const char* prefix) {
+  STATS_TIME(*this, backup);
+  const std::pair<size_t, size_t> range = _range(prefix);
+  const size_t shard = _shardOf(prefix, true);
+  std::string records;
+  {
+    // only the keys of the group are loaded: no snapshot of the whole config
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    for (size_t i = range.first; i < range.second; i++) {
+      if (!_inGroup(_index[i], shard))
+        continue;
+      Entry& entry = _entries[_index[i]];
+      _load(entry);
+      records.append(entry.key).append(1, '=').append(_value(entry)).append(1, '\n');
+    }
+  }
+  out.write(reinterpret_cast<const uint8_t*>(records.data()), records.size());
+}
+
+size_t Mycila::Config::Backup::read(uint8_t* buffer, size_t maxLen) {
+  if (!_snapshot)
+    return 0;
+  const std::vector<const char*>& keys = _config->_keys;
+  size_t written = 0;
+  while (written < maxLen && _record < keys.size()) {
+    // a record is made of key=value\n
+    const char* key = keys[_record];
+    const char* value = _value(_record);
+    const size_t keyLength = strlen(key);
+    const size_t valueLength = strlen(value);
+    const size_t end = keyLength + valueLength + 2;
+    while (written < maxLen && _offset < end) {
+      const char* part;
+      size_t available;
+      if (_offset < keyLength) {
+        part = key + _offset;
+        available = keyLength - _offset;
+      } else if (_offset == keyLength) {
+        part = "=";
+        available = 1;
+      } else if (_offset < end - 1) {
+        part = value + _offset - keyLength - 1;
+        available = end - 1 - _offset;
+      } else {
+        part = "\n";
+        available = 1;
+      }
+      const size_t length = std::min(available, maxLen - written);
+      memcpy(buffer + written, part, length);
+      written += length;
+      _offset += length;
+    }
+    if (_offset == end) {
+      _record++;
+      _offset = 0;
+    }
+  }
+  return written;
+}
+
+size_t Mycila::Config::Backup::size() const {
+  if (!_snapshot)
+    return 0;
+  const std::vector<const char*>& keys = _config->_keys;
+  size_t size = 0;
+  for (size_t i = 0, n = keys.size(); i < n; i++)
+    size += strlen(keys[i]) + strlen(_value(i)) + 2;
+  return size;
+}
+
+const char* Mycila::Config::Backup::_value(size_t index) const {
+  const char* value = _snapshot.get(_config->_index[index]);
+#ifdef MYCILA_CONFIG_PASSWORD_MASK
+  if (_maskPasswords && value[0] != '\0' && _config->isPasswordKey(_config->_keys[index]))
+    return MYCILA_CONFIG_PASSWORD_MASK;
+#endif
+  return value;
+}
+
+bool Mycila::Config::restore(const char* data, const char* prefix) {
+  STATS_TIME(*this, restore);
+  Transaction tx = beginTransaction();
+  std::string line;
+  if (!_restoreRecords(tx, line, data, strlen(data), prefix))
+    return false;
+  if (!line.empty()) {
+    LOGW(TAG, "restore(): Invalid data, last record not terminated");
+    return false;
+  }
+  return _restore(tx);
+}
+
+bool Mycila::Config::restore(Stream& in, const char* prefix) {
+  STATS_TIME(*this, restore);
+  Transaction tx = beginTransaction();
+  std::string line;
+  char buffer[64];
+  size_t length;
+  while ((length = in.readBytes(buffer, sizeof(buffer))) > 0) {
+    if (!_restoreRecords(tx, line, buffer, length, prefix))
+      return false;
+  }
+  if (!line.empty()) {
+    LOGW(TAG, "restore(): Invalid data, last record not terminated");
+    return false;
+  }
+  return _restore(tx);
+}
+
+bool Mycila::Config::_restoreRecords(Transaction& tx, std::string& line, const char* data, size_t length, const char* prefix) const {
+  const size_t prefixLength = strlen(prefix);
+  const size_t shard = _shardOf(prefix, true);
+  const char* end = data + length;
+  while (data < end) {
+    // accumulate the characters of the current record
+    const char* eol = data;
+    while (eol < end && *eol != '\n')
+      eol++;
+    line.append(data, eol - data);
+    if (line.size() > MYCILA_CONFIG_KEY_MAX_LENGTH + 1 + MYCILA_CONFIG_VALUE_MAX_LENGTH) {
+      LOGW(TAG, "restore(): Record too long");
+      return false;
+    }
+    if (eol == end)
+      return true;
+    data = eol + 1;
+
+    // complete record
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    const size_t eq = line.find('=');
+    if (eq != std::string::npos && line.compare(0, prefixLength, prefix) == 0) {
+      const ConfigKeyId id = keyId(std::string_view(line.data(), eq));
+      if (id != CONFIG_KEY_UNKNOWN && _inGroup(id, shard))
+        tx.set(id, line.substr(eq + 1));
+      else if (id != CONFIG_KEY_UNKNOWN)
+        LOGD(TAG, "restore(%s): Key of another shard", _entries[id].key);
+      else
+        LOGD(TAG, "restore(%.*s): Key unknown", static_cast<int>(eq), line.c_str());
+    }
+    line.clear();
+  }
+  return true;
+}
+
+bool Mycila::Config::_restore(Transaction& tx) {
+  LOGD(TAG, "Restoring %d settings...", tx.size());
+  bool restored = _atomicRestore ? _replace(tx._changes) : tx.commit(false);
+  if (restored) {
+    LOGD(TAG, "Config restored");
+    _restored();
+  } else
+    LOGD(TAG, "No change detected");
+  return restored;
+}
+
+bool Mycila::Config::restore(const std::map<const char*, std::string>& settings) {
+  STATS_TIME(*this, restore);
+  Transaction tx = beginTransaction();
+  for (auto& setting : settings)
+    if (keyId(setting.first) != CONFIG_KEY_UNKNOWN)
+      tx.set(setting.first, setting.second);
+  return _restore(tx);
+}
+
+bool Mycila::Config::_replace(std::vector<std::pair<ConfigKeyId, std::string>>& changes) {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+
+  // restored value of each key: the last staged one wins
+  std::vector<const std::string*> restored(_entries.size(), nullptr);
+  for (auto& change : changes)
+    restored[change.first] = &change.second;
+
+  // keys really changed
+  std::vector<ConfigKeyId> changed;
+  for (size_t id = 0, n = _entries.size(); id < n; id++) {
+    if (!restored[id])
+      continue;
+    const Entry& entry = _entries[id];
+    const char* value = restored[id]->c_str();
+    const bool persisted = _isPersisted(entry);
+    const bool same = value[0] == '\0' ? !persisted : persisted ? _persistedEquals(entry, value) : strcmp(_default(entry), value) == 0;
+    if (!same)
+      changed.push_back(id);
+  }
+  if (changed.empty()) {
+    changes.clear();
+    return false;
+  }
+
+  // each shard is replaced atomically
+  size_t staged = 0;
+  while (staged <= _shards.size() && _storageAt(staged).beginStaging())
+    staged++;
+  if (staged <= _shards.size()) {
+    LOGD(TAG, "restore(): Staging not supported by the storage");
+    while (staged)
+      _storageAt(--staged).endStaging(false);
+    lock.unlock();
+    return _commit(changes, false);
+  }
+
+  // the staging area gets the whole new config: the restored values and the other persisted ones, including the pending writes
+  bool written = true;
+  for (size_t id = 0, n = _entries.size(); id < n && written; id++) {
+    Entry& entry = _entries[id];
+    const char* value;
+    if (restored[id]) {
+      value = restored[id]->c_str();
+    } else if (_isPersisted(entry)) {
+      _load(entry);
+      value = _value(entry);
+    } else {
+      continue;
+    }
+    if (value[0] != '\0')
+      written = _put(entry, value);
+  }
+  // the blobs are copied as is
+  for (size_t i = 0, n = _blobs.size(); i < n && written; i++)
+    written = _copyBlob(_blobs[i]);
+  bool replaced = true;
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    replaced = _storageAt(shard).endStaging(written) && replaced;
+  if (!replaced) {
+    LOGE(TAG, "restore(): Unable to replace the config");
+    // the writes went to the staging area: the previous values might still be persisted as strings
+    for (Entry& entry : _entries)
+      entry.maybeString = entry.native;
+    changes.clear();
+    return false;
+  }
+
+  // the pending writes are now persisted
+  for (Entry& entry : _entries)
+    entry.dirty = Dirty::CLEAN;
+  _generation++;
+  for (ConfigKeyId id : changed) {
+    Entry& entry = _entries[id];
+    const std::string& value = *restored[id];
+    if (value.empty())
+      _cacheDefault(entry);
+    else
+      _cache(entry, value.c_str(), value.size());
+    entry.modified = _generation;
+    LOGD(TAG, "set(%s, %s)", entry.key, value.c_str());
+  }
+  changes.clear();
+  return true;
+}
+
+// key of a chunk of a blob: the blob key followed by a 2-digit index
+static void _chunkKey(char* buffer, const char* key, size_t index) {
+  snprintf(buffer, MYCILA_CONFIG_KEY_MAX_LENGTH + 1, "%s.%02u", key, static_cast<unsigned>(index));
+}
+
+static size_t _chunks(size_t length) { return (length + MYCILA_CONFIG_BLOB_CHUNK_SIZE - 1) / MYCILA_CONFIG_BLOB_CHUNK_SIZE; }
+
+bool Mycila::Config::configureBlob(const char* key) {
+  if (strlen(key) > MYCILA_CONFIG_BLOB_KEY_MAX_LENGTH || keyId(key) != CONFIG_KEY_UNKNOWN) {
+    LOGE(TAG, "configureBlob(%s): Invalid key", key);
+    return false;
+  }
+  if (!_blob(key)) {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    _blobs.push_back({key, static_cast<uint8_t>(_shardOf(key))});
+  }
+  LOGD(TAG, "Config Blob '%s'", key);
+  return true;
+}
+
+const Mycila::Config::Blob* Mycila::Config::_blob(const char* key, bool chunks) const {
+  for (const Blob& blob : _blobs) {
+    const size_t length = strlen(blob.key);
+    if (strncmp(key, blob.key, length) != 0)
+      continue;
+    const char* suffix = key + length;
+    if (!suffix[0] || (chunks && suffix[0] == '.' && isdigit(suffix[1]) && isdigit(suffix[2]) && !suffix[3]))
+      return &blob;
+  }
+  return nullptr;
+}
+
+size_t Mycila::Config::_blobSize(const Blob& blob) const {
+  long length = 0; // NOLINT
+  STATS_COUNT(nvsReads);
+  return _storageAt(blob.shard).getLong(blob.key, length) && length > 0 ? length : 0;
+}
+
+bool Mycila::Config::_readChunk(const Blob& blob, size_t index, uint8_t* buffer, size_t size) const {
+  char key[MYCILA_CONFIG_KEY_MAX_LENGTH + 1];
+  _chunkKey(key, blob.key, index);
+  STATS_COUNT(nvsReads);
+  size_t length = size;
+  if (_storageAt(blob.shard).getBytes(key, buffer, &length) != ESP_OK || length != size) {
+    LOGE(TAG, "readBlob(%s): Unable to read chunk %s", blob.key, key);
+    return false;
+  }
+  return true;
+}
+
+size_t Mycila::Config::blobSize(const char* key) const {
+  const Blob* blob = _blob(key);
+  if (!blob)
+    return 0;
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  return _blobSize(*blob);
+}
+
+size_t Mycila::Config::readBlob(const char* key, uint8_t* buffer, size_t size, size_t offset) const {
+  const Blob* blob = _blob(key);
+  if (!blob)
+    return 0;
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  const size_t length = _blobSize(*blob);
+  if (offset >= length)
+    return 0;
+  size = std::min(size, length - offset);
+
+  // chunks read entirely go straight to the buffer, the partial ones through a temporary chunk
+  std::unique_ptr<uint8_t[]> chunk;
+  size_t read = 0;
+  while (read < size) {
+    const size_t index = (offset + read) / MYCILA_CONFIG_BLOB_CHUNK_SIZE;
+    const size_t start = index * MYCILA_CONFIG_BLOB_CHUNK_SIZE;
+    const size_t chunkSize = std::min<size_t>(MYCILA_CONFIG_BLOB_CHUNK_SIZE, length - start);
+    const size_t skip = offset + read - start;
+    const size_t count = std::min(chunkSize - skip, size - read);
+    if (count == chunkSize) {
+      if (!_readChunk(*blob, index, buffer + read, chunkSize))
+        break;
+    } else {
+      if (!chunk)
+        chunk.reset(new uint8_t[MYCILA_CONFIG_BLOB_CHUNK_SIZE]);
+      if (!_readChunk(*blob, index, chunk.get(), chunkSize))
+        break;
+      memcpy(buffer + read, chunk.get() + skip, count);
+    }
+    read += count;
+  }
+  return read;
+}
+
+size_t Mycila::Config::readBlob(const char* key, Print& out) const {
+  const Blob* blob = _blob(key);
+  if (!blob)
+    return 0;
+  std::unique_ptr<uint8_t[]> chunk(new uint8_t[MYCILA_CONFIG_BLOB_CHUNK_SIZE]);
+  size_t length;
+  {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    length = _blobSize(*blob);
+  }
+  size_t written = 0;
+  for (size_t index = 0, n = _chunks(length); index < n; index++) {
+    const size_t chunkSize = std::min<size_t>(MYCILA_CONFIG_BLOB_CHUNK_SIZE, length - index * MYCILA_CONFIG_BLOB_CHUNK_SIZE);
+    {
+      // the blob might be replaced between two chunks: a chunk of another size stops the read
+      std::unique_lock<std::shared_mutex> lock(_mutex);
+      if (!_readChunk(*blob, index, chunk.get(), chunkSize))
+        break;
+    }
+    // a Print like a network client can write a part of the chunk only
+    size_t sent = 0;
+    while (sent < chunkSize) {
+      const size_t count = out.write(chunk.get() + sent, chunkSize - sent);
+      if (!count)
+        return written + sent;
+      sent += count;
+    }
+    written += sent;
+  }
+  return written;
+}
+
+bool Mycila::Config::setBlob(const char* key, const uint8_t* data, size_t length) {
+  const Blob* blob = _blob(key);
+  if (!blob || length > MYCILA_CONFIG_BLOB_MAX_LENGTH) {
+    LOGW(TAG, "setBlob(%s): Unknown key or blob too long!", key);
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  ConfigStorage& storage = _storageAt(blob->shard);
+  const size_t previous = _chunks(_blobSize(*blob));
+  const size_t chunks = _chunks(length);
+  char chunkKey[MYCILA_CONFIG_KEY_MAX_LENGTH + 1];
+  if (!previous && !chunks)
+    return false;
+
+  // the length is removed first and written last: an interrupted write leaves the blob unset
+  if (previous) {
+    storage.remove(key);
+    STATS_COUNT(nvsRemoves);
+  }
+  for (size_t index = 0; index < chunks; index++) {
+    const size_t offset = index * MYCILA_CONFIG_BLOB_CHUNK_SIZE;
+    const size_t chunkSize = std::min<size_t>(MYCILA_CONFIG_BLOB_CHUNK_SIZE, length - offset);
+    _chunkKey(chunkKey, key, index);
+    if (!_written(storage.putBytes(chunkKey, data + offset, chunkSize))) {
+      LOGE(TAG, "setBlob(%s): Unable to write chunk %s", key, chunkKey);
+      storage.commit();
+      return false;
+    }
+  }
+  const bool written = !length || _written(storage.putLong(key, length));
+  // chunks of a longer previous value
+  for (size_t index = chunks; index < previous; index++) {
+    _chunkKey(chunkKey, key, index);
+    storage.remove(chunkKey);
+    STATS_COUNT(nvsRemoves);
+  }
+  if (!storage.commit()) {
+    LOGE(TAG, "setBlob(%s): Commit failed!", key);
+    return false;
+  }
+  LOGD(TAG, "setBlob(%s, %u bytes)", key, length);
+  return written;
+}
+
+bool Mycila::Config::_copyBlob(const Blob& blob) {
+  const size_t length = _blobSize(blob);
+  if (!length)
+    return true;
+  ConfigStorage& storage = _storageAt(blob.shard);
+  std::unique_ptr<uint8_t[]> chunk(new uint8_t[MYCILA_CONFIG_BLOB_CHUNK_SIZE]);
+  char chunkKey[MYCILA_CONFIG_KEY_MAX_LENGTH + 1];
+  for (size_t index = 0, n = _chunks(length); index < n; index++) {
+    const size_t chunkSize = std::min<size_t>(MYCILA_CONFIG_BLOB_CHUNK_SIZE, length - index * MYCILA_CONFIG_BLOB_CHUNK_SIZE);
+    _chunkKey(chunkKey, blob.key, index);
+    if (!_readChunk(blob, index, chunk.get(), chunkSize) || !_written(storage.putBytes(chunkKey, chunk.get(), chunkSize)))
+      return false;
+  }
+  return _written(storage.putLong(blob.key, length));
+}
+
+void Mycila::Config::setCachePolicy(ConfigCachePolicy policy, size_t budget) {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  _cachePolicy = policy;
+  _cacheBudget = policy == ConfigCachePolicy::LRU ? budget : 0;
+  _evict(nullptr);
+}
+
+void Mycila::Config::_cache(Entry& entry, std::string&& value) const {
+  if (_pool) {
+    _cache(entry, value.c_str(), value.size());
+    return;
+  }
+  _reserve(entry, 0);
+  entry.value = std::move(value);
+  entry.length = entry.value.size();
+  _cached(entry);
+}
+
+void Mycila::Config::_cache(Entry& entry, const char* value, size_t length) const {
+  // a value of the pool, like in set("a", get("b")), can be moved or evicted by _reserve(): it is copied first
+  if (_pool && value >= _pool.get() && value < _pool.get() + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE + _arenaSize) {
+    const std::string copy(value, length);
+    memcpy(_reserve(entry, length), copy.c_str(), length);
+  } else {
+    memcpy(_reserve(entry, length), value, length);
+  }
+  _cached(entry);
+}
+
+char* Mycila::Config::_reserve(Entry& entry, size_t length) const {
+  if (entry.cached)
+    _cacheSize -= entry.length;
+  entry.cached = true;
+  entry.isDefault = false;
+  entry.length = length;
+
+  char* pooled = _pool ? _poolAlloc(entry, length + 1) : nullptr;
+  if (pooled) {
+    pooled[length] = '\0';
+    entry.pooled = pooled;
+    std::string().swap(entry.value);
+    return pooled;
+  }
+
+  if (_pool) {
+    _overflows++;
+    LOGW(TAG, "Value pool full: %s allocated on heap", entry.key);
+  }
+  // the capacity of the previous value is reused
+  entry.value.resize(length);
+  return &entry.value[0];
+}
+
+void Mycila::Config::_cached(Entry& entry) const {
+  if (entry.type != ConfigType::STRING)
+    entry.number = _parse(entry.type, _value(entry));
+  entry.lastUse = ++_tick;
+  _cacheSize += entry.length;
+  if (_cachePolicy != ConfigCachePolicy::FULL)
+    _evict(&entry);
+}
+
+esp_err_t Mycila::Config::_loadString(Entry& entry) const {
+  // get the length first, then read the value straight into the cache
+  size_t size = 0;
+  STATS_COUNT(nvsReads);
+  esp_err_t err = _storageOf(entry).getString(entry.key, nullptr, &size);
+  if (err != ESP_OK)
+    return err;
+  if (size <= 1)
+    return ESP_ERR_NVS_INVALID_LENGTH;
+
+  char* buffer = _reserve(entry, size - 1);
+  err = _storageOf(entry).getString(entry.key, buffer, &size);
+  if (err != ESP_OK) {
+    // not yet accounted in the cache size
+    entry.length = 0;
+    _uncache(entry);
+    return err;
+  }
+  _cached(entry);
+  return ESP_OK;
+}
+
+void Mycila::Config::_cacheDefault(Entry& entry) const {
+  _uncache(entry);
+  entry.cached = true;
+  entry.isDefault = true;
+  if (entry.type != ConfigType::STRING)
+    entry.number = _parse(entry.type, _default(entry));
+  entry.lastUse = ++_tick;
+  if (_cachePolicy != ConfigCachePolicy::FULL)
+    _evict(&entry);
+}
+
+void Mycila::Config::_uncache(Entry& entry) const {
+  if (entry.cached)
+    _cacheSize -= entry.length;
+  _poolFree(entry);
+  std::string().swap(entry.value);
+  entry.length = 0;
+  entry.cached = false;
+  entry.isDefault = false;
+}
+
+void Mycila::Config::_evict(const Entry* keep) const {
+  if (_cachePolicy == ConfigCachePolicy::FULL)
+    return;
+  // within the budget: no need to scan the entries
+  if (_cachePolicy == ConfigCachePolicy::LRU && _cacheSize <= _cacheBudget)
+    return;
+  for (;;) {
+    Entry* lru = nullptr;
+    size_t cached = 0;
+    for (Entry& entry : _entries) {
+      // pending write-behind values must stay in cache, default values are not copied in cache
+      if (!entry.cached || entry.isDefault || &entry == keep || entry.dirty != Dirty::CLEAN)
+        continue;
+      cached++;
+      if (!lru || entry.lastUse < lru->lastUse)
+        lru = &entry;
+    }
+    // with no cache, only the last read value is kept
+    if (!lru || (_cachePolicy == ConfigCachePolicy::LRU && _cacheSize <= _cacheBudget))
+      return;
+    _uncache(*lru);
+    _evictions++;
+    if (cached == 1)
+      return;
+  }
+}
+
+// header of a block of the arena, followed by the value
+struct Block {
+    Mycila::ConfigKeyId owner;
+    uint16_t capacity;
+};
+
+bool Mycila::Config::setPool(size_t slots, size_t arenaSize) {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+
+  // move the values out of the current pool
+  for (Entry& entry : _entries) {
+    if (entry.pooled) {
+      entry.value.assign(entry.pooled, entry.length);
+      _poolFree(entry);
+    }
+  }
+
+  slots = std::min<size_t>(slots, CONFIG_KEY_UNKNOWN);
+  arenaSize = arenaSize & ~static_cast<size_t>(3);
+  _pool.reset(slots || arenaSize ? new (std::nothrow) char[slots * MYCILA_CONFIG_POOL_SLOT_SIZE + arenaSize] : nullptr);
+  const bool allocated = _pool || !(slots || arenaSize);
+  _poolSlots = _pool ? slots : 0;
+  _arenaSize = _pool ? arenaSize : 0;
+  _arenaTop = 0;
+  _arenaUsed = 0;
+  _freeSlots.clear();
+  _freeSlots.shrink_to_fit();
+  _freeSlots.reserve(_poolSlots);
+  for (size_t i = _poolSlots; i > 0; i--)
+    _freeSlots.push_back(i - 1);
+
+  if (!allocated)
+    LOGE(TAG, "Unable to allocate a value pool of %zu slots and %zu bytes", slots, arenaSize);
+
+  // move the values in the new pool
+  if (_pool) {
+    for (Entry& entry : _entries) {
+      if (entry.cached && !entry.isDefault) {
+        std::string value = std::move(entry.value);
+        _cache(entry, std::move(value));
+      }
+    }
+  }
+
+  return allocated;
+}
+
+Mycila::ConfigPoolStats Mycila::Config::poolStats() const {
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  ConfigPoolStats stats;
+  stats.slotSize = MYCILA_CONFIG_POOL_SLOT_SIZE;
+  stats.slots = _poolSlots;
+  stats.slotsUsed = _poolSlots - _freeSlots.size();
+  stats.arenaSize = _arenaSize;
+  stats.arenaUsed = _arenaUsed;
+  stats.compactions = _compactions;
+  stats.overflows = _overflows;
+  stats.overflowSize = 0;
+  if (_pool) {
+    for (const Entry& entry : _entries)
+      if (entry.cached && !entry.isDefault && !entry.pooled)
+        stats.overflowSize += entry.value.capacity() + 1;
+  }
+
+  // largest run of free blocks, including the free space after the last block
+  const char* arena = _pool.get() + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  size_t largest = 0;
+  size_t run = 0;
+  for (size_t offset = 0; offset < _arenaTop;) {
+    Block block;
+    memcpy(&block, arena + offset, sizeof(Block));
+    run = block.owner == CONFIG_KEY_UNKNOWN ? run + sizeof(Block) + block.capacity : 0;
+    largest = std::max(largest, run);
+    offset += sizeof(Block) + block.capacity;
+  }
+  stats.arenaLargestFree = std::max(largest, run + _arenaSize - _arenaTop);
+
+  const size_t freeSpace = _arenaSize - _arenaUsed;
+  stats.fragmentation = freeSpace ? 1.0f - static_cast<float>(stats.arenaLargestFree) / freeSpace : 0;
+  return stats;
+}
+
+#ifdef MYCILA_CONFIG_STATS
+static Mycila::ConfigLatency _loadLatency(const Mycila::ConfigLatency& latency) {
+  Mycila::ConfigLatency loaded;
+  loaded.count = __atomic_load_n(&latency.count, __ATOMIC_RELAXED);
+  loaded.min = loaded.count ? __atomic_load_n(&latency.min, __ATOMIC_RELAXED) : 0;
+  loaded.max = __atomic_load_n(&latency.max, __ATOMIC_RELAXED);
+  loaded.total = __atomic_load_n(&latency.total, __ATOMIC_RELAXED);
+  return loaded;
+}
+
+Mycila::ConfigStats Mycila::Config::stats() const {
+  ConfigStats stats = {};
+  stats.nvsReads = __atomic_load_n(&_stats.nvsReads, __ATOMIC_RELAXED);
+  stats.nvsWrites = __atomic_load_n(&_stats.nvsWrites, __ATOMIC_RELAXED);
+  stats.nvsRemoves = __atomic_load_n(&_stats.nvsRemoves, __ATOMIC_RELAXED);
+  stats.cacheHits = __atomic_load_n(&_stats.cacheHits, __ATOMIC_RELAXED);
+  stats.cacheMisses = __atomic_load_n(&_stats.cacheMisses, __ATOMIC_RELAXED);
+  stats.bytesPersisted = __atomic_load_n(&_stats.bytesPersisted, __ATOMIC_RELAXED);
+  stats.callbacks = _loadLatency(_stats.callbacks);
+  stats.get = _loadLatency(_stats.get);
+  stats.set = _loadLatency(_stats.set);
+  stats.restore = _loadLatency(_stats.restore);
+  stats.backup = _loadLatency(_stats.backup);
+  return stats;
+}
+
+void Mycila::Config::resetStats() {
+  for (uint32_t* counter : {&_stats.nvsReads, &_stats.nvsWrites, &_stats.nvsRemoves, &_stats.cacheHits, &_stats.cacheMisses, &_stats.bytesPersisted})
+    __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+  for (ConfigLatency* latency : {&_stats.callbacks, &_stats.get, &_stats.set, &_stats.restore, &_stats.backup}) {
+    __atomic_store_n(&latency->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&latency->min, UINT32_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&latency->max, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&latency->total, 0, __ATOMIC_RELAXED);
+  }
+}
+
+Mycila::ConfigStats Mycila::Config::_emptyStats() {
+  ConfigStats stats = {};
+  for (ConfigLatency* latency : {&stats.callbacks, &stats.get, &stats.set, &stats.restore, &stats.backup})
+    latency->min = UINT32_MAX;
+  return stats;
+}
+
+Mycila::Config::Stopwatch::Stopwatch(ConfigLatency& latency) : _latency(latency), _start(esp_timer_get_time()) {}
+
+Mycila::Config::Stopwatch::~Stopwatch() {
+  const uint32_t elapsed = esp_timer_get_time() - _start;
+  uint32_t min = __atomic_load_n(&_latency.min, __ATOMIC_RELAXED);
+  while (elapsed < min && !__atomic_compare_exchange_n(&_latency.min, &min, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  uint32_t max = __atomic_load_n(&_latency.max, __ATOMIC_RELAXED);
+  while (elapsed > max && !__atomic_compare_exchange_n(&_latency.max, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_fetch_add(&_latency.count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&_latency.total, elapsed, __ATOMIC_RELAXED);
+}
+#endif
+
+char* Mycila::Config::_poolAlloc(Entry& entry, size_t size) const {
+  char* slots = _pool.get();
+  char* arena = slots + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  const bool small = size <= MYCILA_CONFIG_POOL_SLOT_SIZE && _poolSlots;
+
+  // current slot can be reused
+  if (small && entry.pooled && entry.pooled < arena)
+    return entry.pooled;
+
+  // current block is large enough
+  if (entry.pooled && entry.pooled >= arena) {
+    Block block;
+    memcpy(&block, entry.pooled - sizeof(Block), sizeof(Block));
+    if (block.capacity >= size)
+      return entry.pooled;
+  }
+  _poolFree(entry);
+
+  if (small) {
+    // no free slot: the arena is used before evicting anything
+    if (_freeSlots.empty()) {
+      char* data = _arenaAlloc(entry, size, false);
+      if (data)
+        return data;
+    }
+    // only the values held in slots can free a slot
+    while (_freeSlots.empty()) {
+      if (!_poolEvict(&entry, false))
+        return _arenaAlloc(entry, size, true);
+    }
+    char* slot = slots + _freeSlots.back() * MYCILA_CONFIG_POOL_SLOT_SIZE;
+    _freeSlots.pop_back();
+    return slot;
+  }
+
+  return _arenaAlloc(entry, size, true);
+}
+
+char* Mycila::Config::_arenaAlloc(Entry& entry, size_t size, bool evict) const {
+  char* arena = _pool.get() + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  const size_t capacity = (size + 3) & ~static_cast<size_t>(3);
+  if (capacity > UINT16_MAX || sizeof(Block) + capacity > _arenaSize)
+    return nullptr;
+
+  for (;;) {
+    if (_arenaSize - _arenaTop >= sizeof(Block) + capacity) {
+      const Block block = {static_cast<ConfigKeyId>(&entry - _entries.data()), static_cast<uint16_t>(capacity)};
+      memcpy(arena + _arenaTop, &block, sizeof(Block));
+      char* data = arena + _arenaTop + sizeof(Block);
+      _arenaTop += sizeof(Block) + capacity;
+      _arenaUsed += sizeof(Block) + capacity;
+      return data;
+    }
+    // enough free space, but scattered
+    if (_arenaSize - _arenaUsed >= sizeof(Block) + capacity)
+      _poolCompact();
+    // only the values held in the arena can free arena space
+    else if (!evict || !_poolEvict(&entry, true))
+      return nullptr;
+  }
+}
+
+void Mycila::Config::_poolFree(Entry& entry) const {
+  if (!entry.pooled)
+    return;
+  char* slots = _pool.get();
+  char* arena = slots + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  if (entry.pooled < arena) {
+    _freeSlots.push_back((entry.pooled - slots) / MYCILA_CONFIG_POOL_SLOT_SIZE);
+  } else {
+    char* header = entry.pooled - sizeof(Block);
+    Block block;
+    memcpy(&block, header, sizeof(Block));
+    _arenaUsed -= sizeof(Block) + block.capacity;
+    // last block: give its space back to the end of the arena
+    if (entry.pooled + block.capacity == arena + _arenaTop) {
+      _arenaTop -= sizeof(Block) + block.capacity;
+    } else {
+      block.owner = CONFIG_KEY_UNKNOWN;
+      memcpy(header, &block, sizeof(Block));
+    }
+  }
+  entry.pooled = nullptr;
+}
+
+// evict the least recently used value of the slots or of the arena which can be read again from NVS
+bool Mycila::Config::_poolEvict(const Entry* keep, bool inArena) const {
+  const char* arena = _pool.get() + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  Entry* lru = nullptr;
+  for (Entry& entry : _entries) {
+    if (entry.pooled && (entry.pooled >= arena) == inArena && &entry != keep && entry.dirty == Dirty::CLEAN && (!lru || entry.lastUse < lru->lastUse))
+      lru = &entry;
+  }
+  if (!lru)
+    return false;
+  _uncache(*lru);
+  _evictions++;
+  return true;
+}
+
+// move the blocks of the arena to the beginning, so that the free space is contiguous
+void Mycila::Config::_poolCompact() const {
+  char* arena = _pool.get() + _poolSlots * MYCILA_CONFIG_POOL_SLOT_SIZE;
+  size_t top = 0;
+  for (size_t offset = 0; offset < _arenaTop;) {
+    Block block;
+    memcpy(&block, arena + offset, sizeof(Block));
+    const size_t size = sizeof(Block) + block.capacity;
+    if (block.owner != CONFIG_KEY_UNKNOWN) {
+      if (top != offset)
+        memmove(arena + top, arena + offset, size);
+      _entries[block.owner].pooled = arena + top + sizeof(Block);
+      top += size;
+    }
+    offset += size;
+  }
+  _arenaTop = top;
+  _compactions++;
+  LOGD(TAG, "Value pool compacted: %zu bytes used", _arenaTop);
+}
+
+bool Mycila::Config::clear() {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  bool cleared = true;
+  for (size_t shard = 0; shard <= _shards.size(); shard++)
+    cleared = _storageAt(shard).clear() && cleared;
+  cleared = _commitAll() && cleared;
+  // pending writes are dropped: clearing the namespace would erase them anyway
+  for (Entry& entry : _entries) {
+    entry.dirty = Dirty::CLEAN;
+    _uncache(entry);
+  }
+  _generation++;
+  for (Entry& entry : _entries)
+    entry.modified = _generation;
+  return cleared;
+}
+
+bool Mycila::Config::clear(const char* group) {
+  const size_t shard = _shardOf(group, true);
+  if (shard == SIZE_MAX)
+    return false;
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  const bool cleared = _storageAt(shard).clear() && _storageAt(shard).commit();
+  if (!cleared)
+    LOGE(TAG, "clear(%s): Unable to clear the storage", group);
+  _generation++;
+  for (Entry& entry : _entries) {
+    if (entry.shard != shard)
+      continue;
+    entry.dirty = Dirty::CLEAN;
+    _uncache(entry);
+    entry.modified = _generation;
+  }
+  LOGD(TAG, "clear(%s)", group);
+  return cleared;
+}
+
+Mycila::Config::Snapshot Mycila::Config::snapshot() const {
+  {
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    std::shared_ptr<const SnapshotData> last = _snapshot.lock();
+    if (last && last->generation == _generation)
+      return Snapshot(this, std::move(last));
+  }
+
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+
+  // taken by another task in the meantime ?
+  std::shared_ptr<const SnapshotData> last = _snapshot.lock();
+  if (last && last->generation == _generation)
+    return Snapshot(this, std::move(last));
+
+  std::shared_ptr<SnapshotData> data = std::make_shared<SnapshotData>();
+  data->generation = _generation;
+  data->offsets.reserve(_entries.size());
+  data->numbers.reserve(_entries.size());
+  data->buffer.reserve(_cacheSize + _entries.size());
+  data->modified.reserve(_entries.size());
+  data->persisted.reserve(_entries.size());
+  for (Entry& entry : _entries) {
+    _load(entry);
+    const char* value = _value(entry);
+    data->offsets.push_back(data->buffer.size());
+    data->numbers.push_back(entry.number);
+    data->modified.push_back(entry.modified);
+    data->persisted.push_back(_isPersisted(entry));
+    data->buffer.insert(data->buffer.end(), value, value + strlen(value) + 1);
+  }
+
+  _snapshot = data;
+  LOGD(TAG, "Snapshot taken at generation %" PRIu32, data->generation);
+  return Snapshot(this, std::move(data));
+}
+
+uint32_t Mycila::Config::Snapshot::generation() const {
+  return _data ? _data->generation : 0;
+}
+
+const char* Mycila::Config::Snapshot::get(ConfigKeyId id) const {
+  return _data && id < _data->offsets.size() ? &_data->buffer[_data->offsets[id]] : "";
+}
+
+bool Mycila::Config::Snapshot::getBool(ConfigKeyId id) const {
+  if (!_data || id >= _data->offsets.size())
+    return false;
+  return _config->_entries[id].type == ConfigType::BOOL ? _data->numbers[id].b : _parse(ConfigType::BOOL, get(id)).b;
+}
+
+long Mycila::Config::Snapshot::getLong(ConfigKeyId id) const { // NOLINT
+  if (!_data || id >= _data->offsets.size())
+    return 0;
+  const ConfigType type = _config->_entries[id].type;
+  return type == ConfigType::INT || type == ConfigType::LONG ? _data->numbers[id].l : _parse(ConfigType::LONG, get(id)).l;
+}
+
+float Mycila::Config::Snapshot::getFloat(ConfigKeyId id) const {
+  if (!_data || id >= _data->offsets.size())
+    return 0;
+  return _config->_entries[id].type == ConfigType::FLOAT ? _data->numbers[id].f : _parse(ConfigType::FLOAT, get(id)).f;
+}
+
+bool Mycila::Config::isPasswordKey(const char* key) const {
+  uint32_t len = strlen(key);
+  if (len < 4)
+    return false;
+  return strcmp(key + len - 4, MYCILA_CONFIG_KEY_PASSWORD_SUFFIX) == 0;
+}
+
+bool Mycila::Config::isEnableKey(const char* key) const {
+  uint32_t len = strlen(key);
+  if (len < 7)
+    return false;
+  return strcmp(key + len - 7, MYCILA_CONFIG_KEY_ENABLE_SUFFIX) == 0;
+}
+
+Mycila::ConfigKeyId Mycila::Config::keyId(std::string_view key) const {
+  auto it = std::lower_bound(_keys.begin(), _keys.end(), key, [](const char* a, std::string_view b) { return b.compare(a) > 0; });
+  if (it == _keys.end() || key.compare(*it) != 0)
+    return CONFIG_KEY_UNKNOWN;
+  return _index[it - _keys.begin()];
+}
+
+std::pair<size_t, size_t> Mycila::Config::_range(const char* prefix) const {
+  // the keys starting with prefix are contiguous in the sorted keys
+  const size_t length = strlen(prefix);
+  const auto first = std::partition_point(_keys.begin(), _keys.end(), [prefix, length](const char* key) { return strncmp(key, prefix, length) < 0; });
+  const auto last = std::partition_point(first, _keys.end(), [prefix, length](const char* key) { return strncmp(key, prefix, length) == 0; });
+  return {first - _keys.begin(), last - _keys.begin()};
+}
+
+Mycila::ConfigKeyRange Mycila::Config::keys(const char* prefix) const {
+  const std::pair<size_t, size_t> range = _range(prefix);
+  return ConfigKeyRange(_keys.data() + range.first, _keys.data() + range.second);
+}
+
+// accumulates the small writes to a Print in a buffer
+class BufferedPrint {
+  public:
+    explicit BufferedPrint(Print& out) : _out(out) {}
+    ~BufferedPrint() { flush(); }
+    void write(char c) {
+      if (_length == sizeof(_buffer))
+        flush();
+      _buffer[_length++] = c;
+    }
+    void write(const char* str) {
+      while (*str)
+        write(*str++);
+    }
+    void write(const uint8_t* data, size_t length) {
+      if (_length + length > sizeof(_buffer)) {
+        flush();
+        // large data is written as is
+        if (length > sizeof(_buffer)) {
+          _out.write(data, length);
+          return;
+        }
+      }
+      memcpy(_buffer + _length, data, length);
+      _length += length;
+    }
+    void flush() {
+      if (_length)
+        _out.write(_buffer, _length);
+      _length = 0;
+    }
+
+  private:
+    Print& _out;
+    uint8_t _buffer[128];
+    size_t _length = 0;
+};
+
+static void _writeJsonString(BufferedPrint& out, const char* str) {
+  out.write('"');
+  for (; *str; str++) {
+    const char c = *str;
+    switch (c) {
+      case '"':
+        out.write("\\\"");
+        break;
+      case '\\':
+        out.write("\\\\");
+        break;
+      case '\n':
+        out.write("\\n");
+        break;
+      case '\r':
+        out.write("\\r");
+        break;
+      case '\t':
+        out.write("\\t");
+        break;
+      default:
+        if (static_cast<uint8_t>(c) < 0x20) {
+          char escaped[7];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          out.write(escaped);
+        } else {
+          out.write(c);
+        }
+        break;
+    }
+  }
+  out.write('"');
+}
+
+void Mycila::Config::toJson(Print& out) const {
+  const Snapshot values = snapshot();
+  BufferedPrint buffered(out);
+  buffered.write('{');
+  for (size_t i = 0, n = _keys.size(); i < n; i++) {
+    const char* key = _keys[i];
+    const char* value = values.get(_index[i]);
+    if (i)
+      buffered.write(',');
+    _writeJsonString(buffered, key);
+    buffered.write(':');
+#ifdef MYCILA_CONFIG_PASSWORD_MASK
+    _writeJsonString(buffered, value[0] == '\0' || !isPasswordKey(key) ? value : MYCILA_CONFIG_PASSWORD_MASK);
+#else
+    _writeJsonString(buffered, value);
+#endif // MYCILA_CONFIG_PASSWORD_MASK
+  }
+  buffered.write('}');
+}
+
+void Mycila::Config::toJson(Print& out, const char* prefix) const {
+  const std::pair<size_t, size_t> range = _range(prefix);
+  const size_t shard = _shardOf(prefix, true);
+  BufferedPrint buffered(out);
+  buffered.write('{');
+  bool first = true;
+  for (size_t i = range.first; i < range.second; i++) {
+    if (!_inGroup(_index[i], shard))
+      continue;
+    const char* key = _keys[i];
+    // copied while locked: only the keys of the range are read
+    const std::string value = getString(_index[i]);
+    if (!first)
+      buffered.write(',');
+    first = false;
+    _writeJsonString(buffered, key);
+    buffered.write(':');
+#ifdef MYCILA_CONFIG_PASSWORD_MASK
+    _writeJsonString(buffered, value.empty() || !isPasswordKey(key) ? value.c_str() : MYCILA_CONFIG_PASSWORD_MASK);
+#else
+    _writeJsonString(buffered, value.c_str());
+#endif // MYCILA_CONFIG_PASSWORD_MASK
+  }
+  buffered.write('}');
+}
+
+uint32_t Mycila::Config::delta(uint32_t since, Print& out) const {
+  const Snapshot values = snapshot();
+  const SnapshotData& data = *values._data;
+  BufferedPrint buffered(out);
+  for (size_t i = 0, n = data.modified.size(); i < n; i++) {
+    if (data.modified[i] <= since)
+      continue;
+    buffered.write(_entries[i].key);
+    buffered.write('=');
+    if (data.persisted[i])
+      buffered.write(values.get(i));
+    buffered.write('\n');
+  }
+  return data.generation;
+}
+
+#define BINARY_MAGIC   "MCFG"
+#define BINARY_VERSION 1
+
+// FNV-1a hash of a key, identifying it in a binary backup
+static uint32_t _hash(const char* key) {
+  uint32_t hash = 2166136261u;
+  while (*key) {
+    hash ^= static_cast<uint8_t>(*key++);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void _le(uint8_t* buffer, uint32_t value, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    buffer[i] = value >> (8 * i);
+}
+
+static uint32_t _le(const uint8_t* buffer, size_t size) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < size; i++)
+    value |= static_cast<uint32_t>(buffer[i]) << (8 * i);
+  return value;
+}
+
+size_t Mycila::Config::backupBinary(Print& out) const {
+  STATS_TIME(*this, backup);
+  const Snapshot values = snapshot();
+  const SnapshotData& data = *values._data;
+  BufferedPrint buffered(out);
+  uint32_t crc = 0;
+  size_t written = 0;
+  auto emit = [&](const uint8_t* bytes, size_t length) {
+    crc = esp_rom_crc32_le(crc, bytes, length);
+    buffered.write(bytes, length);
+    written += length;
+  };
+
+  uint8_t header[8] = {BINARY_MAGIC[0], BINARY_MAGIC[1], BINARY_MAGIC[2], BINARY_MAGIC[3], BINARY_VERSION, 0};
+  _le(header + 6, data.offsets.size(), 2);
+  emit(header, sizeof(header));
+
+  for (size_t i = 0, n = data.offsets.size(); i < n; i++) {
+    const char* value = &data.buffer[data.offsets[i]];
+    // values are null-terminated in the snapshot buffer
+    const size_t length = (i + 1 < n ? data.offsets[i + 1] : data.buffer.size()) - data.offsets[i] - 1;
+    uint8_t record[6];
+    _le(record, _hash(_entries[i].key), 4);
+    _le(record + 4, length, 2);
+    emit(record, sizeof(record));
+    emit(reinterpret_cast<const uint8_t*>(value), length);
+  }
+
+  uint8_t footer[4];
+  _le(footer, crc, 4);
+  buffered.write(footer, sizeof(footer));
+  return written + sizeof(footer);
+}
+
+bool Mycila::Config::restoreBinary(const uint8_t* data, size_t length) {
+  return _restoreBinary([&data, &length](uint8_t* buffer, size_t size) {
+    if (size > length)
+      return false;
+    memcpy(buffer, data, size);
+    data += size;
+    length -= size;
+    return true;
+  });
+}
+
+bool Mycila::Config::restoreBinary(Stream& in) {
+  return _restoreBinary([&in](uint8_t* buffer, size_t size) { return in.readBytes(buffer, size) == size; });
+}
+
+template <typename R>
+bool Mycila::Config::_restoreBinary(R&& read) {
+  STATS_TIME(*this, restore);
+  uint32_t crc = 0;
+  auto consume = [&](uint8_t* buffer, size_t size) {
+    if (!read(buffer, size))
+      return false;
+    crc = esp_rom_crc32_le(crc, buffer, size);
+    return true;
+  };
+
+  uint8_t header[8];
+  if (!consume(header, sizeof(header)) || memcmp(header, BINARY_MAGIC, 4) != 0 || header[4] != BINARY_VERSION) {
+    LOGW(TAG, "restoreBinary(): Invalid header");
+    return false;
+  }
+
+  // keys sorted by hash
+  std::vector<std::pair<uint32_t, ConfigKeyId>> hashes;
+  hashes.reserve(_entries.size());
+  for (size_t id = 0, n = _entries.size(); id < n; id++)
+    hashes.emplace_back(_hash(_entries[id].key), id);
+  std::sort(hashes.begin(), hashes.end());
+  // the records of keys sharing a hash cannot be told apart
+  for (size_t i = 1, n = hashes.size(); i < n; i++) {
+    if (hashes[i].first == hashes[i - 1].first && hashes[i].second != CONFIG_KEY_UNKNOWN) {
+      LOGW(TAG, "restoreBinary(): Keys %s and %s have the same hash", _entries[hashes[i - 1].second].key, _entries[hashes[i].second].key);
+      hashes[i - 1].second = CONFIG_KEY_UNKNOWN;
+      hashes[i].second = CONFIG_KEY_UNKNOWN;
+    }
+  }
+
+  Transaction tx = beginTransaction();
+  std::string value;
+  for (size_t i = 0, n = _le(header + 6, 2); i < n; i++) {
+    uint8_t record[6];
+    if (!consume(record, sizeof(record))) {
+      LOGW(TAG, "restoreBinary(): Truncated data");
+      return false;
+    }
+    // the length is checked before allocating the value
+    const size_t size = _le(record + 4, 2);
+    if (size > MYCILA_CONFIG_VALUE_MAX_LENGTH) {
+      LOGW(TAG, "restoreBinary(): Invalid record");
+      return false;
+    }
+    value.resize(size);
+    // values are stored as C strings
+    if (!consume(reinterpret_cast<uint8_t*>(&value[0]), value.size()) || memchr(value.data(), '\0', value.size())) {
+      LOGW(TAG, "restoreBinary(): Invalid record");
+      return false;
+    }
+    const uint32_t hash = _le(record, 4);
+    auto it = std::lower_bound(hashes.begin(), hashes.end(), std::make_pair(hash, ConfigKeyId(0)));
+    if (it != hashes.end() && it->first == hash && it->second == CONFIG_KEY_UNKNOWN) {
+      LOGE(TAG, "restoreBinary(): Ambiguous record: %08" PRIx32, hash);
+      return false;
+    }
+    if (it != hashes.end() && it->first == hash)
+      tx.set(it->second, value);
+    else
+      LOGD(TAG, "restoreBinary(): Key unknown: %08" PRIx32, hash);
+  }
+
+  uint8_t footer[4];
+  if (!read(footer, sizeof(footer)) || _le(footer, 4) != crc) {
+    LOGW(TAG, "restoreBinary(): CRC mismatch");
+    return false;
+  }
+  return _restore(tx);
+}
+
+#ifdef MYCILA_JSON_SUPPORT
+  #if ARDUINOJSON_VERSION_MAJOR > 7 || (ARDUINOJSON_VERSION_MAJOR == 7 && ARDUINOJSON_VERSION_MINOR >= 3)
+    #define LINKED(str) JsonString(str, true)
+  #else
+    #define LINKED(str) JsonString(str, JsonString::Linked)
+  #endif
+
+  #ifdef MYCILA_CONFIG_STATS
+void Mycila::ConfigStats::toJson(const JsonObject& root) const {
+  root["nvs_reads"] = nvsReads;
+  root["nvs_writes"] = nvsWrites;
+  root["nvs_removes"] = nvsRemoves;
+  root["cache_hits"] = cacheHits;
+  root["cache_misses"] = cacheMisses;
+  root["bytes_persisted"] = bytesPersisted;
+  const std::pair<const char*, const ConfigLatency*> latencies[] = {{"callbacks", &callbacks}, {"get", &get}, {"set", &set}, {"restore", &restore}, {"backup", &backup}};
+  // the names are copied by ArduinoJson
+  char name[24];
+  for (const auto& latency : latencies) {
+    snprintf(name, sizeof(name), "%s_count", latency.first);
+    root[name] = latency.second->count;
+    snprintf(name, sizeof(name), "%s_min_us", latency.first);
+    root[name] = latency.second->min;
+    snprintf(name, sizeof(name), "%s_max_us", latency.first);
+    root[name] = latency.second->max;
+    snprintf(name, sizeof(name), "%s_avg_us", latency.first);
+    root[name] = latency.second->avg();
+  }
+}
+  #endif
+
+void Mycila::Config::toJson(const JsonObject& root) {
+  toJson(root, "");
+}
+
+void Mycila::Config::toJson(const JsonObject& root, const char* prefix) {
+  const std::pair<size_t, size_t> range = _range(prefix);
+  const size_t shard = _shardOf(prefix, true);
+  for (size_t i = range.first; i < range.second; i++) {
+    if (!_inGroup(_index[i], shard))
+      continue;
+    const char* key = _keys[i];
+    // copied while locked
+    const std::string value = getString(_index[i]);
+  #ifdef MYCILA_CONFIG_PASSWORD_MASK
+    if (!value.empty() && isPasswordKey(key)) {
+      root[LINKED(key)] = LINKED(MYCILA_CONFIG_PASSWORD_MASK);
+      continue;
+    }
+  #endif // MYCILA_CONFIG_PASSWORD_MASK
+    root[LINKED(key)] = value;
+  }
+}
+
+uint32_t Mycila::Config::delta(uint32_t since, const JsonObject& root) const {
+  const Snapshot values = snapshot();
+  const SnapshotData& data = *values._data;
+  for (size_t i = 0, n = data.modified.size(); i < n; i++) {
+    if (data.modified[i] <= since)
+      continue;
+    if (data.persisted[i])
+      root[LINKED(_entries[i].key)] = values.get(i);
+    else
+      root[LINKED(_entries[i].key)] = nullptr;
+  }
+  return data.generation;
+}
+
+bool Mycila::Config::set(const JsonObjectConst& json, bool fireChangeCallback) {
+  Transaction tx = beginTransaction();
+  _stage(tx, json);
+  return tx.commit(fireChangeCallback);
+}
+
+bool Mycila::Config::restore(const JsonObjectConst& json, const char* prefix) {
+  STATS_TIME(*this, restore);
+  Transaction tx = beginTransaction();
+  _stage(tx, json, prefix);
+  return _restore(tx);
+}
+
+void Mycila::Config::_stage(Transaction& tx, const JsonObjectConst& json, const char* prefix) const {
+  const size_t prefixLength = strlen(prefix);
+  const size_t shard = _shardOf(prefix, true);
+  for (JsonPairConst pair : json) {
+    const JsonString key = pair.key();
+    if (key.size() < prefixLength || strncmp(key.c_str(), prefix, prefixLength) != 0)
+      continue;
+    const ConfigKeyId id = keyId(std::string_view(key.c_str(), key.size()));
+    if (id == CONFIG_KEY_UNKNOWN) {
+      LOGD(TAG, "set(%s): Key unknown", key.c_str());
+      continue;
+    }
+    if (!_inGroup(id, shard))
+      continue;
+
+    const JsonVariantConst value = pair.value();
+    if (value.isNull()) {
+      tx.unset(id);
+      continue;
+    }
+    if (value.is<const char*>()) {
+      tx.set(id, value.as<const char*>());
+      continue;
+    }
+    if (!value.is<bool>() && !value.is<float>()) {
+      LOGW(TAG, "set(%s): Unsupported JSON value", key.c_str());
+      continue;
+    }
+
+    // bool and number values of string keys are kept as written in the JSON
+    const ConfigType type = _entries[id].type;
+    if (type == ConfigType::STRING) {
+      char buffer[32];
+      tx.set(id, std::string(buffer, serializeJson(value, buffer, sizeof(buffer))));
+      continue;
+    }
+
+    // others are converted to the type of the key
+    Number number;
+    switch (type) {
+      case ConfigType::BOOL:
+        number.b = value.as<bool>();
+        break;
+      case ConfigType::FLOAT:
+        number.f = value.as<float>();
+        break;
+      default:
+        number.l = value.as<long>(); // NOLINT
+        break;
+    }
+    tx.set(id, _format(type, number));
+  }
+}
+
+void Mycila::Config::toJson(const JsonObject& root, const Snapshot& snapshot) const {
+  for (size_t i = 0, n = _keys.size(); i < n; i++) {
+    const char* key = _keys[i];
+    const char* value = snapshot.get(_index[i]);
   #ifdef MYCILA_CONFIG_PASSWORD_MASK
-    root[key] = value.empty() || !isPasswordKey(key) ? value : MYCILA_CONFIG_PASSWORD_MASK;
+    root[LINKED(key)] = LINKED(value[0] == '\0' || !isPasswordKey(key) ? value : MYCILA_CONFIG_PASSWORD_MASK);
   #else
-    root[key] = value;
+    root[LINKED(key)] = LINKED(value);
   #endif // MYCILA_CONFIG_PASSWORD_MASK
   }
 }
@@ -4,19 +4,50 @@
  */
 #pragma once
 
-#include <Preferences.h>
+#include "MycilaConfigStorage.h"
+
+#include <esp_idf_version.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #ifdef MYCILA_JSON_SUPPORT
   #include <ArduinoJson.h>
 #endif
 
-#define MYCILA_CONFIG_VERSION          "7.0.3"
-#define MYCILA_CONFIG_VERSION_MAJOR    7
+#define MYCILA_CONFIG_VERSION          "8.0.0"
+#define MYCILA_CONFIG_VERSION_MAJOR    8
 #define MYCILA_CONFIG_VERSION_MINOR    0
-#define MYCILA_CONFIG_VERSION_REVISION 3
+#define MYCILA_CONFIG_VERSION_REVISION 0
+
+// maximum length of a key, imposed by NVS
+#define MYCILA_CONFIG_KEY_MAX_LENGTH 15
+
+// maximum length of a value persisted as a string, imposed by NVS
+#define MYCILA_CONFIG_VALUE_MAX_LENGTH 3999
+
+// maximum length of a blob key: the chunks are persisted under the key followed by a 3-character suffix
+#define MYCILA_CONFIG_BLOB_KEY_MAX_LENGTH 12
+
+// size of the chunks of a blob, and maximum size of a blob (100 chunks)
+#ifndef MYCILA_CONFIG_BLOB_CHUNK_SIZE
+  #define MYCILA_CONFIG_BLOB_CHUNK_SIZE 1024
+#endif
+#define MYCILA_CONFIG_BLOB_MAX_LENGTH (100 * MYCILA_CONFIG_BLOB_CHUNK_SIZE)
 
 // suffix to use for a setting key enabling a feature
 #define MYCILA_CONFIG_KEY_ENABLE_SUFFIX "_enable"
@@ -24,6 +55,11 @@
 // suffix to use for a setting key representing a password
 #define MYCILA_CONFIG_KEY_PASSWORD_SUFFIX "_pwd"
 
+// size of the fixed-size slots of the value pool: values shorter than this size (including the null terminator) use a slot
+#ifndef MYCILA_CONFIG_POOL_SLOT_SIZE
+  #define MYCILA_CONFIG_POOL_SLOT_SIZE 16
+#endif
+
 #ifndef MYCILA_CONFIG_SHOW_PASSWORD
   #ifndef MYCILA_CONFIG_PASSWORD_MASK
     #define MYCILA_CONFIG_PASSWORD_MASK "********"
@@ -34,17 +70,299 @@ namespace Mycila {
   typedef std::function<void(const char* key, const std::string& newValue)> ConfigChangeCallback;
   typedef std::function<void()> ConfigRestoredCallback;
 
+  // handle of a subscription, used to unsubscribe
+  typedef uint32_t ConfigSubscriptionId;
+
+  // dense integer ID of a configuration key: keys are numbered in registration order
+  typedef uint16_t ConfigKeyId;
+
+  // ID returned when a key is not configured
+  constexpr ConfigKeyId CONFIG_KEY_UNKNOWN = UINT16_MAX;
+
+  // IDs of the keys changed during a batch window, in ID order
+  typedef std::function<void(const std::vector<ConfigKeyId>& keys)> ConfigBatchCallback;
+
+  enum class ConfigType : uint8_t {
+    STRING,
+    BOOL,
+    INT,
+    LONG,
+    FLOAT,
+  };
+
+  enum class ConfigCachePolicy : uint8_t {
+    // all the values are kept in cache once read (default)
+    FULL,
+    // the least recently used values are evicted when the cached values exceed a byte budget
+    LRU,
+    // values are read from NVS on each access: only the last read value is kept
+    NONE,
+  };
+
+  // memory usage of the value pool (see Config::setPool())
+  struct ConfigPoolStats {
+      // fixed-size slots for short values
+      size_t slotSize;
+      size_t slots;
+      size_t slotsUsed;
+      // compacting arena for long values
+      size_t arenaSize;
+      // bytes used by the values stored in the arena, including their block header
+      size_t arenaUsed;
+      // largest contiguous free space in the arena
+      size_t arenaLargestFree;
+      // 0 when the free space of the arena is contiguous, close to 1 when it is scattered in small holes
+      float fragmentation;
+      // number of times the arena was compacted
+      uint32_t compactions;
+      // number of values which did not fit in the pool and were allocated on the heap
+      uint32_t overflows;
+      // number of bytes currently allocated on the heap for overflowed values
+      size_t overflowSize;
+  };
+
+  // what happens to a change event when the asynchronous dispatch queue is full (see Config::setAsyncDispatch())
+  enum class ConfigDispatchOverflow : uint8_t {
+    // the caller waits until there is room in the queue (default)
+    BLOCK,
+    // the new event is dropped
+    DROP_NEWEST,
+    // the oldest queued event is dropped to make room
+    DROP_OLDEST,
+  };
+
+#ifdef MYCILA_CONFIG_STATS
+  // durations of an operation, in microseconds
+  struct ConfigLatency {
+      uint32_t count;
+      uint32_t min;
+      uint32_t max;
+      uint64_t total;
+      uint32_t avg() const { return count ? total / count : 0; }
+  };
+
+  // performance counters, enabled at compile time with MYCILA_CONFIG_STATS (see Config::stats())
+  struct ConfigStats {
+      // operations of the storage (NVS by default)
+      uint32_t nvsReads;
+      uint32_t nvsWrites;
+      uint32_t nvsRemoves;
+      uint32_t cacheHits;
+      uint32_t cacheMisses;
+      // bytes written to NVS
+      uint32_t bytesPersisted;
+      // listener, subscription and restore callbacks invoked, and the time spent in them
+      ConfigLatency callbacks;
+      ConfigLatency get;
+      ConfigLatency set;
+      ConfigLatency restore;
+      ConfigLatency backup;
+  #ifdef MYCILA_JSON_SUPPORT
+      // flat metrics: nvs_reads, ..., get_count, get_min_us, get_max_us, get_avg_us, ...
+      void toJson(const JsonObject& root) const;
+  #endif
+  };
+#endif
+
+  // compile-time description of a configuration key, used to declare a schema as a constexpr table:
+  //   static constexpr Mycila::ConfigKey SCHEMA[] = {
+  //     {"debug_enable", "false", Mycila::ConfigType::BOOL},
+  //     {"wifi_ssid", "", Mycila::ConfigType::STRING},
+  //   };
+  //   static constexpr Mycila::ConfigKeyId KEY_DEBUG_ENABLE = Mycila::Config::keyId(SCHEMA, "debug_enable");
+  // Keys declared with a type keep their parsed value in the cache, so typed getters do not parse the string value.
+  // When native is true, the value of a typed key is persisted with the corresponding NVS type instead of a string.
+  struct ConfigKey {
+      const char* name;
+      const char* defaultValue;
+      ConfigType type;
+      bool native = false;
+  };
+
+  // contiguous block of the sorted keys, for example the keys starting with a prefix (see Config::keys())
+  class ConfigKeyRange {
+    public:
+      ConfigKeyRange(const char* const* first, const char* const* last) : _first(first), _last(last) {}
+      const char* const* begin() const { return _first; }
+      const char* const* end() const { return _last; }
+      const char* operator[](size_t index) const { return _first[index]; }
+      size_t size() const { return _last - _first; }
+      bool empty() const { return _first == _last; }
+
+    private:
+      const char* const* _first;
+      const char* const* _last;
+  };
+
+  // Config is safe to use from several tasks once all the keys are configured:
+  // readers hitting the cache do not block each other, while writes and NVS accesses are serialized.
+  // The value returned by get() stays valid until the key is changed:
+  // a task reading a key changed concurrently by another task should use getString(), which copies it while locked, or a snapshot().
   class Config {
+    private:
+      struct SnapshotData;
+
     public:
+      // Immutable view of all the values at a given generation, cheap to copy and safe to read from any task without locking.
+      // A task can keep a snapshot and only refresh it when Config::generation() differs from Snapshot::generation().
+      // The memory of a snapshot is released when the last copy is destroyed.
+      class Snapshot {
+        public:
+          Snapshot() = default;
+
+          // false for a default-constructed snapshot
+          explicit operator bool() const { return _data != nullptr; }
+
+          // generation of the config when the snapshot was taken
+          uint32_t generation() const;
+
+          // returns "" for unknown keys, never returns nullptr
+          const char* get(ConfigKeyId id) const;
+          const char* get(const char* key) const { return _config ? get(_config->keyId(key)) : ""; }
+          bool getBool(ConfigKeyId id) const;
+          long getLong(ConfigKeyId id) const; // NOLINT
+          int getInt(ConfigKeyId id) const { return getLong(id); }
+          float getFloat(ConfigKeyId id) const;
+
+        private:
+          friend class Config;
+          Snapshot(const Config* config, std::shared_ptr<const SnapshotData> data) : _config(config), _data(std::move(data)) {}
+          const Config* _config = nullptr;
+          std::shared_ptr<const SnapshotData> _data;
+      };
+
+      // Pull-based backup generator over a snapshot of the config, to produce a backup by chunks,
+      // for example to feed a chunked HTTP response:
+      //   Mycila::Config::Backup backup = config.beginBackup(true);
+      //   request->beginChunkedResponse("text/plain", [backup](uint8_t* buffer, size_t maxLen, size_t index) mutable {
+      //     return backup.read(buffer, maxLen);
+      //   });
+      // The output is the one of backup(Print&) and does not depend on the size of the buffers.
+      class Backup {
+        public:
+          Backup() = default;
+
+          // fills the buffer with the next bytes of the backup
+          // returns the number of bytes written, 0 when the backup is complete
+          size_t read(uint8_t* buffer, size_t maxLen);
+
+          // total size of the backup in bytes
+          size_t size() const;
+
+        private:
+          friend class Config;
+          Backup(const Config* config, Snapshot snapshot, bool maskPasswords) : _config(config), _snapshot(std::move(snapshot)), _maskPasswords(maskPasswords) {}
+          const char* _value(size_t index) const;
+          const Config* _config = nullptr;
+          Snapshot _snapshot;
+          bool _maskPasswords = false;
+          // current record, in key order, and offset in this record
+          size_t _record = 0;
+          size_t _offset = 0;
+      };
+
+      // Stages changes in memory and applies them all at once on commit(), in a single pass over the storage.
+      // Change callbacks are only fired after the commit, once per changed key.
+      // Like for set(std::map), the keys enabling a feature are applied last.
+      // Staged changes are not visible through get() before commit() and are discarded on rollback() or destruction.
+      class Transaction {
+        public:
+          explicit Transaction(Config& config) : _config(&config) {}
+          Transaction(Transaction&& other) = default;
+          Transaction& operator=(Transaction&& other) = default;
+          ~Transaction() { rollback(); }
+
+          // stage a change
+          // returns false if the key is unknown
+          bool set(const char* key, const char* value);
+          bool set(const char* key, std::string value);
+          bool set(ConfigKeyId id, const char* value) { return set(id, std::string(value ? value : "")); }
+          bool set(ConfigKeyId id, std::string value);
+          bool setBool(const char* key, bool value) { return set(key, value ? "true" : "false"); }
+          bool setBool(ConfigKeyId id, bool value) { return set(id, value ? "true" : "false"); }
+          bool unset(const char* key) { return set(key, ""); }
+          bool unset(ConfigKeyId id) { return set(id, std::string()); }
+
+          // number of staged changes
+          size_t size() const { return _changes.size(); }
+
+          // apply the staged changes
+          // returns true if at least one key was changed
+          bool commit(bool fireChangeCallback = true);
+
+          // discard the staged changes
+          void rollback() { _changes.clear(); }
+
+        private:
+          friend class Config;
+          Config* _config;
+          std::vector<std::pair<ConfigKeyId, std::string>> _changes;
+      };
+
       ~Config();
 
       // Add a new configuration key with its default value
-      void configure(const char* key, const char* defaultValue);
-      void configure(const char* key, const std::string& defaultValue) { configure(key, defaultValue.c_str()); }
-      void configure(const char* key, std::string&& defaultValue = std::string());
+      // Default values located in flash (string literals) are referenced without being copied: other default values are copied,
+      // except the std::string ones given by rvalue, which are moved.
+      // returns the ID of the key, which can be used with the ID-based getters and setters
+      ConfigKeyId configure(const char* key, const char* defaultValue, ConfigType type = ConfigType::STRING, bool native = false);
+      ConfigKeyId configure(const char* key, const std::string& defaultValue, ConfigType type = ConfigType::STRING, bool native = false) { return configure(key, defaultValue.c_str(), type, native); }
+      ConfigKeyId configure(const char* key, std::string&& defaultValue = std::string(), ConfigType type = ConfigType::STRING, bool native = false);
+
+      // Add all the keys of a schema table at once: the keys are sorted only once.
+      // New keys get IDs in table order, starting at the number of keys already configured:
+      // when the schema is configured first, the ID of a key is its index in the table (see keyId()).
+      // returns the ID of the first key of the table, or CONFIG_KEY_UNKNOWN if a key is duplicated in the table (nothing is configured)
+      ConfigKeyId configure(const ConfigKey* schema, size_t count);
+      ConfigKeyId configure(std::initializer_list<ConfigKey> schema) { return configure(schema.begin(), schema.size()); }
+      template <size_t N>
+      ConfigKeyId configure(const ConfigKey (&schema)[N]) { return configure(schema, N); }
+
+      // pre-allocate the storage for the given total number of keys
+      void reserve(size_t count);
+
+      // returns the index of a key in a schema table, at compile-time, or CONFIG_KEY_UNKNOWN
+      template <size_t N>
+      static constexpr ConfigKeyId keyId(const ConfigKey (&schema)[N], const char* key) {
+        for (size_t i = 0; i < N; i++) {
+          const char* a = schema[i].name;
+          const char* b = key;
+          while (*a && *a == *b) {
+            a++;
+            b++;
+          }
+          if (*a == *b)
+            return static_cast<ConfigKeyId>(i);
+        }
+        return CONFIG_KEY_UNKNOWN;
+      }
+
+      // starts the config system, persisted in the given NVS namespace
+      // preload = true preloads the keys which are not in a shard: all the keys must then be configured before begin()
+      void begin(const char* name = "CONFIG", bool preload = false) { begin(_nvs, name, preload); }
 
-      // starts the config system
-      void begin(const char* name = "CONFIG");
+      // starts the config system, persisted in another storage (see MycilaConfigStorage.h)
+      // the storage must outlive the config
+      void begin(ConfigStorage& storage, const char* name = "CONFIG", bool preload = false);
+
+      // Persist the keys starting with prefix (a group) in their own NVS namespace, or in another storage, instead of the one given to begin().
+      // The keys of all the shards share the same index: get(), set(), transactions and backups work across the shards,
+      // while clear(group), backup(out, group) and preload(group) only touch the storage of the group.
+      // backup(), toJson() and restore() given the prefix of a shard select its keys only, not the ones of a nested shard.
+      // preload = true preloads the group in begin(), so that hot groups are cached while the other ones stay lazy.
+      // A key goes to the shard with the longest matching prefix. Must be called before begin().
+      // returns false if the prefix is empty or already mapped, if there are too many shards or if begin() was called
+      bool shard(const char* prefix, const char* name, bool preload = false);
+      bool shard(const char* prefix, ConfigStorage& storage, const char* name, bool preload = false);
+
+      // Load all the persisted values in the cache in a single pass over the storage.
+      // Configured keys not persisted are cached with their default value, so no storage read happens afterwards.
+      // Persisted entries which are not configured or not assigned to a value are removed:
+      // all the keys must be configured before calling this method, except the blobs, whose chunks are always kept.
+      void preload();
+      // preload the keys of a shard only
+      // returns false if the group is not a shard prefix
+      bool preload(const char* group);
 
       // register a callback to be called when a config value changes
       void listen(ConfigChangeCallback callback) { _changeCallback = callback; }
@@ -52,45 +370,265 @@ namespace Mycila {
       // register a callback to be called when the configuration is restored
       void listen(ConfigRestoredCallback callback) { _restoreCallback = callback; }
 
+      // Register a callback called only when the given key changes, or when a key starting with the given prefix changes.
+      // Several callbacks can subscribe to the same keys: they are called in subscription order, after the listen() callback.
+      // The subscribers of each key are computed once, so a change is only dispatched to the interested callbacks.
+      // Like listen(), subscriptions must be made before the config is shared between tasks.
+      // returns the subscription handle to pass to unsubscribe()
+      ConfigSubscriptionId subscribe(const char* key, ConfigChangeCallback callback) { return _subscribe(key, false, std::move(callback)); }
+      ConfigSubscriptionId subscribe(ConfigKeyId id, ConfigChangeCallback callback) { return _subscribe(key(id) ? key(id) : "", false, std::move(callback)); }
+      ConfigSubscriptionId subscribePrefix(const char* prefix, ConfigChangeCallback callback) { return _subscribe(prefix, true, std::move(callback)); }
+      // Register a callback notified once per window of windowMs with the set of the keys starting with prefix which changed.
+      // The window starts at the first change, and each key is reported once whatever the number of changes:
+      // the callback reads the last values with get(). An empty prefix subscribes to all the keys.
+      // The callback is called from the FreeRTOS timer task.
+      ConfigSubscriptionId subscribeBatch(const char* prefix, uint32_t windowMs, ConfigBatchCallback callback);
+
+      bool unsubscribe(ConfigSubscriptionId subscription);
+
+      // Deliver the change and restore callbacks from a dedicated task instead of the task calling set() or restore().
+      // Events are queued in order with a copy of the new value, in a queue of queueLength events:
+      // overflow tells what happens when the queue is full.
+      // Callbacks calling set() are delivered synchronously from the dispatch task.
+      // queueLength = 0 delivers the queued events, stops the task and goes back to synchronous callbacks (default).
+      // Cannot be called from a callback delivered by the dispatch task.
+      // returns false if the queue or the task cannot be created
+      bool setAsyncDispatch(size_t queueLength, ConfigDispatchOverflow overflow = ConfigDispatchOverflow::BLOCK, uint32_t stackSize = 4096, UBaseType_t priority = 1);
+
+      // number of change events dropped because the dispatch queue was full
+      uint32_t droppedEvents() const { return _droppedEvents; }
+
       // get the value of a setting key
       // returns "" if the key is not found, never returns nullptr
-      const char* get(const char* key) const { return getString(key).c_str(); }
-      const std::string& getString(const char* key) const;
+      // get() does not copy the value: keys not persisted are served straight from their default value.
+      // getString() returns a copy of the value.
+      // numeric getters return 0 when the value is not a number
+      const char* get(const char* key) const;
+      std::string getString(const char* key) const { return get(key); }
+      const char* get(std::string_view key) const;
+      std::string getString(std::string_view key) const { return get(key); }
       bool getBool(const char* key) const;
-      long getLong(const char* key) const { return std::stol(get(key)); } // NOLINT
-      int getInt(const char* key) const { return std::stoi(get(key)); }   // NOLINT
-      float getFloat(const char* key) const { return std::stof(get(key)); }
-      bool isEmpty(const char* key) const { return get(key)[0] == '\0'; }
-      bool isEqual(const char* key, const std::string& value) const { return get(key) == value; }
-      bool isEqual(const char* key, const char* value) const { return strcmp(get(key), value) == 0; }
+      long getLong(const char* key) const; // NOLINT
+      int getInt(const char* key) const { return getLong(key); }
+      float getFloat(const char* key) const;
+      // isEmpty() and isEqual() compare the value while locked
+      bool isEmpty(const char* key) const;
+      bool isEqual(const char* key, const std::string& value) const { return isEqual(key, value.c_str()); }
+      bool isEqual(const char* key, const char* value) const;
+
+      // get the value of a setting key by its ID: no key lookup is done
+      // typed getters called on keys of the same type only load the cached parsed value
+      const char* get(ConfigKeyId id) const;
+      std::string getString(ConfigKeyId id) const;
+      bool getBool(ConfigKeyId id) const;
+      long getLong(ConfigKeyId id) const; // NOLINT
+      int getInt(ConfigKeyId id) const { return getLong(id); }
+      float getFloat(ConfigKeyId id) const;
+      bool isEmpty(ConfigKeyId id) const;
+      bool isEqual(ConfigKeyId id, const std::string& value) const { return isEqual(id, value.c_str()); }
+      bool isEqual(ConfigKeyId id, const char* value) const;
 
       bool set(const char* key, const char* value, bool fireChangeCallback = true);
       bool set(const char* key, const std::string& value, bool fireChangeCallback = true) { return set(key, value.c_str(), fireChangeCallback); }
       bool set(const char* key, const std::string&& value, bool fireChangeCallback = true);
 
+      // set several keys at once in a transaction
       bool set(const std::map<const char*, std::string>& settings, bool fireChangeCallback = true);
+#ifdef MYCILA_JSON_SUPPORT
+      // Set the keys of a JSON object at once in a transaction: unknown keys are ignored, null values unset the keys.
+      // Bool and number values are converted with the type of their key: string keys get them as written in the JSON.
+      bool set(const JsonObjectConst& json, bool fireChangeCallback = true);
+#endif
       bool setBool(const char* key, bool value) { return set(key, value ? "true" : "false"); }
 
       bool unset(const char* key, bool fireChangeCallback = true) { return set(key, "", fireChangeCallback); }
 
+      bool set(ConfigKeyId id, const char* value, bool fireChangeCallback = true);
+      bool set(ConfigKeyId id, const std::string& value, bool fireChangeCallback = true) { return set(id, value.c_str(), fireChangeCallback); }
+      bool set(ConfigKeyId id, const std::string&& value, bool fireChangeCallback = true);
+      bool setBool(ConfigKeyId id, bool value) { return set(id, value ? "true" : "false"); }
+      bool unset(ConfigKeyId id, bool fireChangeCallback = true) { return set(id, "", fireChangeCallback); }
+
+      // Get an immutable snapshot of all the current values.
+      // The last snapshot is reused as long as the generation does not change and a caller still holds it:
+      // once released, its copy of the values is freed.
+      // All the values are loaded in cache to take a new snapshot.
+      Snapshot snapshot() const;
+
+      // Generation counter, increased each time a value is changed by set(), restore() or clear().
+      // This is a single atomic load.
+      uint32_t generation() const { return _generation.load(std::memory_order_acquire); }
+
+      // start a transaction to stage several changes and apply them at once
+      Transaction beginTransaction() { return Transaction(*this); }
+
       bool isPasswordKey(const char* key) const;
       bool isEnableKey(const char* key) const;
 
       void backup(Print& out); // NOLINT
-      bool restore(const char* data);
+      // backup only the keys starting with prefix, for example the keys of a shard:
+      // the other keys are not read from the storage, and the keys are found with a binary search
+      void backup(Print& out, const char* prefix); // NOLINT
+
+      // start a pull-based backup: the values are the ones of the config when this method is called
+      // maskPasswords = true replaces the values of the password keys by MYCILA_CONFIG_PASSWORD_MASK
+      Backup beginBackup(bool maskPasswords = false) const { return Backup(this, snapshot(), maskPasswords); }
+
+      // Binary backup, made of:
+      // - a header: "MCFG", the format version (1 byte), a reserved byte and the number of records (2 bytes)
+      // - the records: the FNV-1a hash of the key (4 bytes), the length of the value (2 bytes) and the value
+      // - the CRC32 of the header and records (4 bytes)
+      // Numbers are little-endian. Values can contain any character but '\0'.
+      // returns the number of bytes written
+      size_t backupBinary(Print& out) const; // NOLINT
+
+      // Restore a binary backup in a single pass: nothing is applied if the backup is invalid or if its CRC32 does not match.
+      // The records of unknown keys are ignored.
+      // The backup is rejected if it contains a record of two configured keys having the same hash, or a value containing '\0'.
+      bool restoreBinary(const uint8_t* data, size_t length);
+      bool restoreBinary(Stream& in); // NOLINT
+
+      // Restore a backup made of key=value records, each one terminated by \n or \r\n.
+      // The records are parsed in a single pass and applied at once: unknown keys are ignored,
+      // and nothing is applied if the last record is not terminated or if a record is too long.
+      // restore(Stream&) reads the backup by chunks, without buffering it entirely.
+      // With a prefix, only the records of the keys starting with prefix are applied.
+      bool restore(const char* data, const char* prefix = "");
+      bool restore(Stream& in, const char* prefix = ""); // NOLINT
       bool restore(const std::map<const char*, std::string>& settings);
 
-      // clear all saved settings and current cache
-      void clear();
+      // When enabled, restore() replaces the persisted values atomically if the storage supports staging (NVS storage):
+      // the new config is written to a staging namespace with a single commit, which then becomes the active namespace,
+      // so a power loss during a restore keeps either the old or the new config.
+      // With shards, each shard is replaced atomically, and all of them must support staging.
+      // Other storages do a regular restore. Disabled by default.
+      void setAtomicRestore(bool enable) { _atomicRestore = enable; }
+#ifdef MYCILA_JSON_SUPPORT
+      bool restore(const JsonObjectConst& json, const char* prefix = "");
+#endif
+
+      // clear all saved settings and current cache, in all the shards
+      // pending write-behind changes are dropped
+      // returns false if a storage could not be cleared or committed
+      bool clear();
+      // clear the storage of a shard only, and the cache of its keys
+      // returns false if the group is not a shard prefix or if its storage could not be cleared
+      bool clear(const char* group);
+
+      // Enable the write-behind mode when delayMs > 0: set() updates the cache and fires the callbacks right away,
+      // but the changes are only persisted when flush() is called or delayMs after the first pending change, one write per key.
+      // Pending changes are also flushed when the Config is destroyed.
+      // delayMs = 0 flushes the pending changes and goes back to writing on each set() (default).
+      void setWriteBehind(uint32_t delayMs);
+
+      // Set how values are kept in memory once read.
+      // With LRU and NONE, the value returned by get() for a key
+      // is only guaranteed to stay valid until the next get() / getString() call of another key.
+      // Values pending a write-behind flush are always kept in cache.
+      // budget: maximum number of bytes of cached values for LRU
+      void setCachePolicy(ConfigCachePolicy policy, size_t budget = 0);
+      ConfigCachePolicy getCachePolicy() const { return _cachePolicy; }
+
+      // number of bytes of cached values
+      size_t cacheSize() const { return _cacheSize; }
+
+      // number of values evicted from the cache since boot
+      uint32_t cacheEvictions() const { return _evictions; }
+
+      // Store the cached values in a pool allocated once instead of one heap allocation per value,
+      // so that the heap does not get fragmented when values change often.
+      // Values shorter than MYCILA_CONFIG_POOL_SLOT_SIZE use one of the fixed-size slots,
+      // longer values use an arena which is compacted when its free space gets scattered.
+      // Short values go to the arena when all the slots are used.
+      // When the pool is full, the least recently used values which are persisted are evicted from the cache:
+      // only the values of the slots to free a slot, only the values of the arena to make room in the arena.
+      // Only values pending a write-behind flush overflow to the heap when there is nothing left to evict.
+      // With a pool, the value returned by get() for a key is only guaranteed to stay valid
+      // until the next get() / set() call of another key: use getString() to keep a value.
+      // slots = 0 and arenaSize = 0 goes back to heap-allocated values (default).
+      // returns false if the pool cannot be allocated
+      bool setPool(size_t slots, size_t arenaSize);
+
+      // memory usage of the value pool
+      ConfigPoolStats poolStats() const;
+
+#ifdef MYCILA_CONFIG_STATS
+      // performance counters since boot or since the last call to resetStats()
+      ConfigStats stats() const;
+      void resetStats();
+#endif
+
+      // persist the pending write-behind changes
+      // returns the number of keys written or removed
+      size_t flush();
+
+      // Blobs: large binary values, like certificates or JSON fragments, persisted in chunks of MYCILA_CONFIG_BLOB_CHUNK_SIZE bytes.
+      // The length is persisted under the key and the chunks under key.00, key.01...
+      // Blobs are never cached and are not part of the keys, backups, snapshots and JSON exports:
+      // they are read chunk by chunk straight into a buffer or to a Print, so they cost no resident heap.
+      // Like the keys, the blob key is referenced, not copied.
+      // returns false if the key is too long or is a configured key
+      bool configureBlob(const char* key);
+      // length of a blob, 0 when it is not set or not configured
+      size_t blobSize(const char* key) const;
+      // reads up to size bytes of a blob from offset into buffer
+      // returns the number of bytes read
+      size_t readBlob(const char* key, uint8_t* buffer, size_t size, size_t offset = 0) const;
+      // writes a blob to out, one chunk at a time: the lock is not held while writing to out
+      // returns the number of bytes written
+      size_t readBlob(const char* key, Print& out) const; // NOLINT
+      // an empty blob is removed: changes of blobs are not reported to the listeners
+      // returns false if the blob is not configured, too long or not written
+      bool setBlob(const char* key, const uint8_t* data, size_t length);
+      bool unsetBlob(const char* key) { return setBlob(key, nullptr, 0); }
 
       // get list of keys
       const std::vector<const char*>& keys() const { return _keys; }
 
+      // get the keys starting with prefix, in a few binary searches over the sorted keys
+      // the range is invalidated when a key is configured
+      ConfigKeyRange keys(const char* prefix) const;
+
       // this method can be used to find the right pointer to a supported key given a random buffer
-      const char* keyRef(const char* buffer) const;
+      const char* keyRef(const char* buffer) const { return key(keyId(buffer)); }
+      const char* keyRef(std::string_view buffer) const { return key(keyId(buffer)); }
+
+      // get the ID of a configured key, or CONFIG_KEY_UNKNOWN
+      // the key is looked up by content with a binary search: the pointer does not need to be the configured one
+      ConfigKeyId keyId(const char* key) const { return key ? keyId(std::string_view(key)) : CONFIG_KEY_UNKNOWN; }
+      ConfigKeyId keyId(std::string_view key) const;
+
+      // get the key name of an ID, or nullptr
+      const char* key(ConfigKeyId id) const { return id < _entries.size() ? _entries[id].key : nullptr; }
+
+      // get the type of a key
+      ConfigType type(ConfigKeyId id) const { return id < _entries.size() ? _entries[id].type : ConfigType::STRING; }
 
+      // generation of the last change of a key, or 0
+      uint32_t modified(ConfigKeyId id) const { return id < _entries.size() ? _entries[id].modified : 0; }
+
+      // Export the keys changed after the generation since, for a synchronization, in the backup format.
+      // Keys not persisted anymore have an empty value, which unsets them when the delta is given to restore().
+      // Passwords are not masked.
+      // returns the generation of the delta, to pass as since for the next delta
+      uint32_t delta(uint32_t since, Print& out) const; // NOLINT
 #ifdef MYCILA_JSON_SUPPORT
+      // keys not persisted anymore have a null value, which unsets them when the delta is given to restore()
+      uint32_t delta(uint32_t since, const JsonObject& root) const;
+#endif
+
+      // write the config as a JSON object, with masked passwords, straight to a Print without any JsonDocument
+      void toJson(Print& out) const; // NOLINT
+      // only the keys starting with prefix
+      void toJson(Print& out, const char* prefix) const; // NOLINT
+
+#ifdef MYCILA_JSON_SUPPORT
+      // keys are linked into the document instead of being copied, values are copied
       void toJson(const JsonObject& root);
+      void toJson(const JsonObject& root, const char* prefix);
+      // keys and values are linked into the document instead of being copied:
+      // the snapshot must be kept alive until the document is serialized
+      void toJson(const JsonObject& root, const Snapshot& snapshot) const;
 #endif
 
     private:
@@ -98,14 +636,276 @@ namespace Mycila {
                       GET,
                       SET,
                       UNSET };
+
+      // write-behind state of a key
+      enum class Dirty : uint8_t { CLEAN,
+                                   PUT,
+                                   REMOVE };
+
+      // parsed value of a typed key
+      union Number {
+          bool b;
+          long l; // NOLINT
+          float f;
+      };
+
+      struct SnapshotData {
+          uint32_t generation;
+          // all the values, null-terminated, at the offset of their ID
+          std::vector<char> buffer;
+          std::vector<uint32_t> offsets;
+          std::vector<Number> numbers;
+          // generation of the last change of each key, and whether it is persisted
+          std::vector<uint32_t> modified;
+          std::vector<bool> persisted;
+      };
+
+      // a configured key, indexed by its ID
+      struct Entry {
+          const char* key;
+          // value in flash, or nullptr when the default value is ownedDefault
+          const char* defaultValue;
+          std::string ownedDefault;
+          // cached value, valid when cached is true and isDefault is false
+          // always cached when dirty
+          std::string value;
+          // cached value stored in the pool instead of value, or nullptr
+          char* pooled;
+          // size of the cached value
+          uint16_t length;
+          ConfigType type;
+          bool native;
+          bool cached;
+          // the key is not persisted: its value is defaultValue and is not copied in the cache
+          // when cached is true, isDefault tells whether the key is persisted without reading NVS
+          bool isDefault;
+          Dirty dirty;
+          // parsed cached value of a typed key, valid when cached is true
+          Number number;
+          // last access tick, for the LRU cache policy
+          uint32_t lastUse;
+          // generation of the last change of the value
+          uint32_t modified;
+          // 0 for the storage given to begin(), or index in _shards + 1
+          uint8_t shard;
+          // native key which might still be persisted as a string: checked by the next write
+          bool maybeString;
+      };
+
+      // a blob key, read from the storage on each access
+      struct Blob {
+          const char* key;
+          uint8_t shard;
+      };
+
+      // keys of a group, persisted in their own storage
+      struct Shard {
+          std::string prefix;
+          std::string name;
+          ConfigStorage* storage;
+          // NVS storage created by shard(prefix, name)
+          std::unique_ptr<ConfigNVSStorage> nvs;
+          bool preload;
+      };
+
+      // changes of a batch subscriber, collected until its timer fires
+      struct Batch {
+          ConfigBatchCallback callback;
+          TimerHandle_t timer;
+          std::mutex mutex;
+          std::vector<ConfigKeyId> pending;
+          // the timer is started: cleared when it fires, or when it could not be started so that the next change retries
+          bool armed = false;
+          // unsubscribed: the timer is deleted and must not be started anymore
+          bool stopped = false;
+#ifdef MYCILA_CONFIG_STATS
+          const Config* config;
+#endif
+      };
+
+      struct Subscriber {
+          ConfigSubscriptionId id;
+          // key name, or prefix of the key names
+          std::string match;
+          bool prefix;
+          // shared with the notifications in progress: a callback can unsubscribe while it runs
+          std::shared_ptr<const ConfigChangeCallback> callback;
+          // set for batch subscribers, instead of callback
+          std::shared_ptr<Batch> batch;
+      };
+
       ConfigChangeCallback _changeCallback = nullptr;
+      // guards _subscribers and _dispatch, which are changed by subscribe() / unsubscribe() while other tasks notify
+      mutable std::mutex _subscribersMutex;
+      std::vector<Subscriber> _subscribers;
+      // indexes in _subscribers of the subscribers of each key, by key ID
+      std::vector<std::vector<uint16_t>> _dispatch;
+      ConfigSubscriptionId _lastSubscription = 0;
+
+      // event of the asynchronous dispatch queue
+      struct Event {
+          enum class Type : uint8_t { CHANGE,
+                                      RESTORE,
+                                      STOP } type;
+          ConfigKeyId id;
+          // new value of a CHANGE event, owned by the event
+          std::string* value;
+      };
+      // read by the dispatch task: only created and deleted while the task is not running
+      QueueHandle_t _dispatchQueue = nullptr;
+      SemaphoreHandle_t _dispatchStopped = nullptr;
+      // compared without lock: the dispatch task delivers its own events synchronously, without waiting for _dispatchMutex
+      std::atomic<TaskHandle_t> _dispatchTask{nullptr};
+      // held shared by the tasks queuing an event, exclusively to open or close the queue
+      mutable std::shared_mutex _dispatchMutex;
+      // events are queued, guarded by _dispatchMutex
+      bool _dispatchOpen = false;
+      ConfigDispatchOverflow _dispatchOverflow = ConfigDispatchOverflow::BLOCK;
+      std::atomic<uint32_t> _droppedEvents{0};
       ConfigRestoredCallback _restoreCallback = nullptr;
+      // keys sorted by name
       std::vector<const char*> _keys;
-      mutable Preferences _prefs;
-      mutable std::map<const char*, std::string> _defaults;
-      mutable std::map<const char*, std::string> _cache;
+      // IDs of the keys in _keys order, used for binary searches by key name
+      std::vector<ConfigKeyId> _index;
+      ConfigNVSStorage _nvs;
+      ConfigStorage* _storage = &_nvs;
+      bool _begun = false;
+      std::vector<Shard> _shards;
+      std::vector<Blob> _blobs;
+      mutable std::vector<Entry> _entries;
       const std::string empty;
+      // readers share the lock on cache hits, cache misses and writers take it exclusively
+      mutable std::shared_mutex _mutex;
+      uint32_t _writeBehindDelay = 0;
+      bool _atomicRestore = false;
+      TimerHandle_t _flushTimer = nullptr;
+      ConfigCachePolicy _cachePolicy = ConfigCachePolicy::FULL;
+      size_t _cacheBudget = 0;
+      mutable size_t _cacheSize = 0;
+      mutable uint32_t _evictions = 0;
+      mutable std::atomic<uint32_t> _tick{0};
+      std::atomic<uint32_t> _generation{0};
+      // last snapshot taken, only kept while a caller holds it
+      mutable std::weak_ptr<const SnapshotData> _snapshot;
+      // value pool: slots followed by the arena, in a single allocation
+      std::unique_ptr<char[]> _pool;
+      size_t _poolSlots = 0;
+      size_t _arenaSize = 0;
+      mutable std::vector<uint16_t> _freeSlots;
+      // end of the last block allocated in the arena
+      mutable size_t _arenaTop = 0;
+      mutable size_t _arenaUsed = 0;
+      mutable uint32_t _compactions = 0;
+      mutable uint32_t _overflows = 0;
+      mutable size_t _overflowSize = 0;
+#ifdef MYCILA_CONFIG_STATS
+      // adds the duration of its scope to a latency
+      class Stopwatch {
+        public:
+          explicit Stopwatch(ConfigLatency& latency);
+          ~Stopwatch();
+
+        private:
+          ConfigLatency& _latency;
+          int64_t _start;
+      };
+      // counters and latencies are updated with relaxed atomics: the min of a latency is UINT32_MAX until its first count
+      mutable ConfigStats _stats = _emptyStats();
+      static ConfigStats _emptyStats();
+#endif
 
-      Op _set(const char* key, const char* value, bool fireChangeCallback);
+      // index = false skips the insertion in the sorted index, which is then done by the caller
+      // defaultValue = nullptr uses ownedDefault
+      ConfigKeyId _configure(const char* key, const char* defaultValue, std::string&& ownedDefault, ConfigType type, bool native, bool index = true);
+      ConfigKeyId _lookup(const char* key) const;
+      Number _number(ConfigKeyId id, ConfigType type) const;
+      static Number _number(const Entry& entry, ConfigType type);
+      void _load(Entry& entry) const;
+      template <typename F>
+      auto _read(Entry& entry, F&& reader) const;
+      static const char* _default(const Entry& entry) { return entry.defaultValue ? entry.defaultValue : entry.ownedDefault.c_str(); }
+      static const char* _value(const Entry& entry) { return entry.isDefault ? _default(entry) : entry.pooled ? entry.pooled : entry.value.c_str(); }
+      void _touch(Entry& entry) const;
+      static Number _parse(ConfigType type, const char* value);
+      static std::string _format(ConfigType type, const Number& number);
+      bool _readNative(const Entry& entry, Number& number) const;
+      bool _persistedEquals(const Entry& entry, const char* value) const;
+      bool _put(Entry& entry, const char* value);
+      // native keys hold the value formatted as it is read back from NVS
+      static std::string _normalize(const Entry& entry, const char* value) { return _format(entry.type, _parse(entry.type, value)); }
+      // accounts for the bytes written to the storage, returns true if something was written
+      bool _written(size_t bytes);
+      Op _set(ConfigKeyId id, const char* value);
+      void _cache(Entry& entry, std::string&& value) const;
+      void _cache(Entry& entry, const char* value, size_t length) const;
+      // prepares the cache storage of a value and returns the buffer, null-terminated, to write the value to
+      char* _reserve(Entry& entry, size_t length) const;
+      // completes the caching of a value written in the buffer returned by _reserve()
+      void _cached(Entry& entry) const;
+      // reads a value persisted as a string straight into the cache
+      // returns ESP_ERR_NVS_INVALID_LENGTH when the persisted value is empty
+      esp_err_t _loadString(Entry& entry) const;
+      void _cacheDefault(Entry& entry) const;
+      void _uncache(Entry& entry) const;
+      char* _poolAlloc(Entry& entry, size_t size) const;
+      // allocates a block in the arena, evicting the least recently used blocks if allowed
+      char* _arenaAlloc(Entry& entry, size_t size, bool evict) const;
+      void _poolFree(Entry& entry) const;
+      bool _poolEvict(const Entry* keep, bool inArena) const;
+      void _poolCompact() const;
+      void _evict(const Entry* keep) const;
+      bool _commit(std::vector<std::pair<ConfigKeyId, std::string>>& changes, bool fireChangeCallback);
+      // stages the complete records of a chunk of a backup: the incomplete last record is kept in line
+      bool _restoreRecords(Transaction& tx, std::string& line, const char* data, size_t length, const char* prefix) const;
+      bool _restore(Transaction& tx);
+      // applies the changes by rewriting all the persisted values in the staging area of the storage
+      // returns false if nothing changed, or if the storage did not switch to the new values
+      bool _replace(std::vector<std::pair<ConfigKeyId, std::string>>& changes);
+      template <typename R>
+      bool _restoreBinary(R&& read);
+#ifdef MYCILA_JSON_SUPPORT
+      void _stage(Transaction& tx, const JsonObjectConst& json, const char* prefix = "") const;
+#endif
+      bool _isPersisted(const Entry& entry) const;
+      // positions in _keys of the first key starting with prefix and after the last one
+      std::pair<size_t, size_t> _range(const char* prefix) const;
+      // storage of a shard index, 0 being the storage given to begin()
+      ConfigStorage& _storageAt(size_t shard) const { return shard ? *_shards[shard - 1].storage : *_storage; }
+      ConfigStorage& _storageOf(const Entry& entry) const { return _storageAt(entry.shard); }
+      // shard index of a key, or of a group when exact is true (SIZE_MAX if the group is not a shard)
+      size_t _shardOf(const char* key, bool exact = false) const;
+      // whether a key belongs to the group of a shard index returned by _shardOf(group, true), true for SIZE_MAX
+      bool _inGroup(ConfigKeyId id, size_t shard) const { return shard == SIZE_MAX || _entries[id].shard == shard; }
+      void _preload(size_t shard);
+      // blob of a blob key, or of the key of one of its chunks when chunks is true
+      const Blob* _blob(const char* key, bool chunks = false) const;
+      // the lock must be held by the caller
+      size_t _blobSize(const Blob& blob) const;
+      bool _readChunk(const Blob& blob, size_t index, uint8_t* buffer, size_t size) const;
+      // writes a blob in the staging area of its storage
+      bool _copyBlob(const Blob& blob);
+      // commits the writes of all the storages, returns false if one of them failed
+      bool _commitAll();
+      // commits the write of a set(), the entry is kept dirty if it failed
+      bool _commitEntry(Entry& entry, Op op);
+      ConfigSubscriptionId _subscribe(const char* match, bool prefix, ConfigChangeCallback callback, std::shared_ptr<Batch> batch = nullptr);
+      // the subscribers lock must be held by the caller
+      void _dispatchKey(ConfigKeyId id);
+      bool _listened(ConfigKeyId id) const;
+      void _notify(ConfigKeyId id, const std::string& value) const;
+      static void _batchChanged(Batch& batch, ConfigKeyId id);
+      static void _batchTimer(TimerHandle_t timer);
+      // stops the timer of a batch and frees the batch once the timer task cannot use it anymore
+      static void _deleteBatch(std::shared_ptr<Batch> batch);
+      static void _deleteTimer(TimerHandle_t timer);
+      // flush() with the lock held
+      size_t _flush();
+      // delivers a change or restore event, synchronously or through the dispatch queue
+      void _changed(ConfigKeyId id, const std::string& value);
+      void _restored();
+      // the dispatch lock must be held shared by the caller, with the queue open
+      void _enqueue(const Event& event);
+      static void _dispatchLoop(void* params);
+      void _scheduleFlush();
   };
 } // namespace Mycila
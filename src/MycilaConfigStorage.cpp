@@ -0,0 +1,530 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023-2024 Mathieu Carbou
+ */
+#include "MycilaConfigStorage.h"
+
+#include <esp_idf_version.h>
+#include <esp_log.h>
+#include <freertos/task.h>
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+  #include <esp_rom_crc.h>
+#else
+  #include <rom/crc.h>
+  #define esp_rom_crc32_le crc32_le
+#endif
+
+#include <string.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+
+#ifdef MYCILA_LOGGER_SUPPORT
+  #include <MycilaLogger.h>
+extern Mycila::Logger logger;
+  #define LOGD(tag, format, ...) logger.debug(tag, format, ##__VA_ARGS__)
+  #define LOGI(tag, format, ...) logger.info(tag, format, ##__VA_ARGS__)
+  #define LOGW(tag, format, ...) logger.warn(tag, format, ##__VA_ARGS__)
+  #define LOGE(tag, format, ...) logger.error(tag, format, ##__VA_ARGS__)
+#else
+  #define LOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+  #define LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+  #define LOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+  #define LOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#endif
+
+#define TAG "CONFIG"
+
+// NVS
+
+// namespace recording the active namespace of each storage, by name
+#define META_NAMESPACE "mycila_config"
+
+Mycila::ConfigNVSStorage::~ConfigNVSStorage() {
+  end();
+  _waitErased();
+  if (_erased)
+    vSemaphoreDelete(_erased);
+}
+
+bool Mycila::ConfigNVSStorage::begin(const char* name) {
+  end();
+  _name = name;
+  _slot = 0;
+  nvs_handle_t meta;
+  if (nvs_open(META_NAMESPACE, NVS_READONLY, &meta) == ESP_OK) {
+    nvs_get_u8(meta, name, &_slot);
+    nvs_close(meta);
+  }
+  return _open();
+}
+
+void Mycila::ConfigNVSStorage::end() {
+  if (_staging)
+    endStaging(false);
+  if (_handle) {
+    nvs_close(_handle);
+    _handle = 0;
+  }
+  if (!_active.empty()) {
+    _prefs.end();
+    _active.clear();
+  }
+}
+
+std::string Mycila::ConfigNVSStorage::_namespace(uint8_t slot) const {
+  // slot 0 is the namespace given to begin(), so that existing configs are kept
+  return slot ? _name.substr(0, NVS_KEY_NAME_MAX_SIZE - 2) + "~" : _name;
+}
+
+bool Mycila::ConfigNVSStorage::_open() {
+  _active = _namespace(_slot);
+  if (!_prefs.begin(_active.c_str(), false))
+    return false;
+  if (nvs_open(_active.c_str(), NVS_READONLY, &_handle) != ESP_OK) {
+    LOGE(TAG, "Unable to open NVS namespace: %s", _active.c_str());
+    return false;
+  }
+  return true;
+}
+
+Mycila::ConfigStorageType Mycila::ConfigNVSStorage::type(const char* key) const {
+  switch (_prefs.getType(key)) {
+    case PT_STR:
+      return ConfigStorageType::STRING;
+    case PT_U8:
+      return ConfigStorageType::BOOL;
+    case PT_I32:
+      return ConfigStorageType::LONG;
+    case PT_BLOB:
+      // Preferences::putFloat() writes the bytes of the float
+      return _prefs.getBytesLength(key) == sizeof(float) ? ConfigStorageType::FLOAT : ConfigStorageType::BLOB;
+    case PT_INVALID:
+      return ConfigStorageType::NONE;
+    default:
+      return ConfigStorageType::OTHER;
+  }
+}
+
+size_t Mycila::ConfigNVSStorage::putString(const char* key, const char* value) {
+  if (_staging)
+    return nvs_set_str(_staging, key, value) == ESP_OK ? strlen(value) : 0;
+  return _prefs.putString(key, value);
+}
+
+size_t Mycila::ConfigNVSStorage::putBool(const char* key, bool value) {
+  if (_staging)
+    return nvs_set_u8(_staging, key, value) == ESP_OK ? 1 : 0;
+  return _prefs.putBool(key, value);
+}
+
+size_t Mycila::ConfigNVSStorage::putLong(const char* key, long value) { // NOLINT
+  if (_staging)
+    return nvs_set_i32(_staging, key, value) == ESP_OK ? sizeof(int32_t) : 0;
+  return _prefs.putLong(key, value);
+}
+
+size_t Mycila::ConfigNVSStorage::putFloat(const char* key, float value) {
+  // encoded like Preferences::putFloat()
+  if (_staging)
+    return nvs_set_blob(_staging, key, &value, sizeof(value)) == ESP_OK ? sizeof(value) : 0;
+  return _prefs.putFloat(key, value);
+}
+
+size_t Mycila::ConfigNVSStorage::putBytes(const char* key, const void* data, size_t length) {
+  if (_staging)
+    return nvs_set_blob(_staging, key, data, length) == ESP_OK ? length : 0;
+  return _prefs.putBytes(key, data, length);
+}
+
+bool Mycila::ConfigNVSStorage::remove(const char* key) {
+  if (_staging)
+    return nvs_erase_key(_staging, key) == ESP_OK;
+  return _prefs.remove(key);
+}
+
+bool Mycila::ConfigNVSStorage::clear() {
+  if (_staging)
+    return nvs_erase_all(_staging) == ESP_OK;
+  return _prefs.clear();
+}
+
+esp_err_t Mycila::ConfigNVSStorage::getString(const char* key, char* buffer, size_t* size) const {
+  return nvs_get_str(_handle, key, buffer, size);
+}
+
+bool Mycila::ConfigNVSStorage::getBool(const char* key, bool& value) const {
+  if (_prefs.getType(key) != PT_U8)
+    return false;
+  value = _prefs.getBool(key);
+  return true;
+}
+
+bool Mycila::ConfigNVSStorage::getLong(const char* key, long& value) const { // NOLINT
+  if (_prefs.getType(key) != PT_I32)
+    return false;
+  value = _prefs.getLong(key);
+  return true;
+}
+
+bool Mycila::ConfigNVSStorage::getFloat(const char* key, float& value) const {
+  if (_prefs.getBytesLength(key) != sizeof(float))
+    return false;
+  value = _prefs.getFloat(key);
+  return true;
+}
+
+esp_err_t Mycila::ConfigNVSStorage::getBytes(const char* key, void* buffer, size_t* size) const {
+  return nvs_get_blob(_handle, key, buffer, size);
+}
+
+void Mycila::ConfigNVSStorage::list(std::function<void(const char* key, ConfigStorageType type)> callback) const {
+#if ESP_IDF_VERSION_MAJOR >= 5
+  nvs_iterator_t it = nullptr;
+  esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, _active.c_str(), NVS_TYPE_ANY, &it);
+  while (err == ESP_OK) {
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    callback(info.key, info.type == NVS_TYPE_STR ? ConfigStorageType::STRING : type(info.key));
+    err = nvs_entry_next(&it);
+  }
+#else
+  nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, _active.c_str(), NVS_TYPE_ANY);
+  while (it) {
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    callback(info.key, info.type == NVS_TYPE_STR ? ConfigStorageType::STRING : type(info.key));
+    it = nvs_entry_next(it);
+  }
+#endif
+  nvs_release_iterator(it);
+}
+
+bool Mycila::ConfigNVSStorage::beginStaging() {
+  if (_active.empty() || _staging)
+    return false;
+  // the staging namespace might still be erased from a previous replacement
+  _waitErased();
+  const std::string staging = _namespace(!_slot);
+  if (nvs_open(staging.c_str(), NVS_READWRITE, &_staging) != ESP_OK) {
+    LOGE(TAG, "Unable to open NVS namespace: %s", staging.c_str());
+    _staging = 0;
+    return false;
+  }
+  // leftovers of an interrupted replacement
+  if (nvs_erase_all(_staging) != ESP_OK) {
+    nvs_close(_staging);
+    _staging = 0;
+    return false;
+  }
+  return true;
+}
+
+bool Mycila::ConfigNVSStorage::endStaging(bool apply) {
+  if (!_staging)
+    return false;
+
+  // all the staged values are written at once
+  bool staged = apply && nvs_commit(_staging) == ESP_OK;
+  nvs_close(_staging);
+  _staging = 0;
+  if (!staged) {
+    _erase(_namespace(!_slot));
+    return false;
+  }
+
+  // the switch is a single NVS write: after a power loss, the active namespace is either the old or the new one
+  nvs_handle_t meta;
+  if (nvs_open(META_NAMESPACE, NVS_READWRITE, &meta) != ESP_OK) {
+    LOGE(TAG, "Unable to open NVS namespace: %s", META_NAMESPACE);
+    _erase(_namespace(!_slot));
+    return false;
+  }
+  const bool switched = nvs_set_u8(meta, _name.c_str(), !_slot) == ESP_OK && nvs_commit(meta) == ESP_OK;
+  nvs_close(meta);
+  if (!switched) {
+    LOGE(TAG, "Unable to switch the active NVS namespace of: %s", _name.c_str());
+    _erase(_namespace(!_slot));
+    return false;
+  }
+
+  const std::string previous = _active;
+  nvs_close(_handle);
+  _handle = 0;
+  _prefs.end();
+  _slot = !_slot;
+  if (!_open()) {
+    // the previous namespace is kept: it is the only copy until the new one can be read
+    LOGE(TAG, "Unable to open the new NVS namespace of: %s", _name.c_str());
+    return false;
+  }
+  LOGD(TAG, "Active NVS namespace: %s", _active.c_str());
+  _erase(previous);
+  return true;
+}
+
+static void _eraseAll(const char* ns) {
+  nvs_handle_t handle;
+  if (nvs_open(ns, NVS_READWRITE, &handle) == ESP_OK) {
+    nvs_erase_all(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+  }
+}
+
+void Mycila::ConfigNVSStorage::_erase(std::string ns) {
+  _waitErased();
+  if (!_erased)
+    _erased = xSemaphoreCreateBinary();
+  _erasing = std::move(ns);
+  if (!_erased || xTaskCreate(_eraseTask, "mycila_erase", 3072, this, 1, nullptr) != pdPASS) {
+    _eraseAll(_erasing.c_str());
+    _erasing.clear();
+  }
+}
+
+void Mycila::ConfigNVSStorage::_waitErased() {
+  if (_erasing.empty())
+    return;
+  xSemaphoreTake(_erased, portMAX_DELAY);
+  _erasing.clear();
+}
+
+void Mycila::ConfigNVSStorage::_eraseTask(void* params) {
+  ConfigNVSStorage* storage = static_cast<ConfigNVSStorage*>(params);
+  _eraseAll(storage->_erasing.c_str());
+  xSemaphoreGive(storage->_erased);
+  vTaskDelete(NULL);
+}
+
+// RAM
+
+const Mycila::ConfigRAMStorage::Value* Mycila::ConfigRAMStorage::_find(const char* key, ConfigStorageType type) const {
+  auto it = _values.find(key);
+  return it != _values.end() && it->second.type == type ? &it->second : nullptr;
+}
+
+size_t Mycila::ConfigRAMStorage::_put(const char* key, ConfigStorageType type, const void* data, size_t size) {
+  Value& value = _values[key];
+  value.type = type;
+  value.data.assign(static_cast<const char*>(data), size);
+  _dirty = true;
+  return size;
+}
+
+Mycila::ConfigStorageType Mycila::ConfigRAMStorage::type(const char* key) const {
+  auto it = _values.find(key);
+  return it == _values.end() ? ConfigStorageType::NONE : it->second.type;
+}
+
+esp_err_t Mycila::ConfigRAMStorage::getString(const char* key, char* buffer, size_t* size) const {
+  const Value* value = _find(key, ConfigStorageType::STRING);
+  if (!value)
+    return ESP_ERR_NVS_NOT_FOUND;
+  const size_t length = value->data.size() + 1;
+  if (buffer) {
+    if (*size < length)
+      return ESP_ERR_NVS_INVALID_LENGTH;
+    memcpy(buffer, value->data.c_str(), length);
+  }
+  *size = length;
+  return ESP_OK;
+}
+
+bool Mycila::ConfigRAMStorage::getBool(const char* key, bool& value) const {
+  const Value* v = _find(key, ConfigStorageType::BOOL);
+  if (!v)
+    return false;
+  value = v->data[0];
+  return true;
+}
+
+bool Mycila::ConfigRAMStorage::getLong(const char* key, long& value) const { // NOLINT
+  const Value* v = _find(key, ConfigStorageType::LONG);
+  if (!v)
+    return false;
+  int32_t number;
+  memcpy(&number, v->data.data(), sizeof(number));
+  value = number;
+  return true;
+}
+
+bool Mycila::ConfigRAMStorage::getFloat(const char* key, float& value) const {
+  const Value* v = _find(key, ConfigStorageType::FLOAT);
+  if (!v)
+    return false;
+  memcpy(&value, v->data.data(), sizeof(value));
+  return true;
+}
+
+esp_err_t Mycila::ConfigRAMStorage::getBytes(const char* key, void* buffer, size_t* size) const {
+  const Value* value = _find(key, ConfigStorageType::BLOB);
+  if (!value)
+    return ESP_ERR_NVS_NOT_FOUND;
+  if (buffer) {
+    if (*size < value->data.size())
+      return ESP_ERR_NVS_INVALID_LENGTH;
+    memcpy(buffer, value->data.data(), value->data.size());
+  }
+  *size = value->data.size();
+  return ESP_OK;
+}
+
+size_t Mycila::ConfigRAMStorage::putString(const char* key, const char* value) {
+  const size_t length = strlen(value);
+  // like Preferences, the number of bytes written excludes the null terminator
+  return _put(key, ConfigStorageType::STRING, value, length) == length ? length : 0;
+}
+
+size_t Mycila::ConfigRAMStorage::putBool(const char* key, bool value) {
+  const uint8_t byte = value;
+  return _put(key, ConfigStorageType::BOOL, &byte, sizeof(byte));
+}
+
+size_t Mycila::ConfigRAMStorage::putLong(const char* key, long value) { // NOLINT
+  // same range as NVS
+  const int32_t number = value;
+  return _put(key, ConfigStorageType::LONG, &number, sizeof(number));
+}
+
+size_t Mycila::ConfigRAMStorage::putFloat(const char* key, float value) {
+  return _put(key, ConfigStorageType::FLOAT, &value, sizeof(value));
+}
+
+size_t Mycila::ConfigRAMStorage::putBytes(const char* key, const void* data, size_t length) {
+  return _put(key, ConfigStorageType::BLOB, data, length);
+}
+
+bool Mycila::ConfigRAMStorage::remove(const char* key) {
+  auto it = _values.find(key);
+  if (it == _values.end())
+    return false;
+  _values.erase(it);
+  _dirty = true;
+  return true;
+}
+
+bool Mycila::ConfigRAMStorage::clear() {
+  _values.clear();
+  _dirty = true;
+  return true;
+}
+
+void Mycila::ConfigRAMStorage::list(std::function<void(const char* key, ConfigStorageType type)> callback) const {
+  for (const auto& value : _values)
+    callback(value.first.c_str(), value.second.type);
+}
+
+// File
+// - a header: "MCFS" and the format version (1 byte)
+// - the records: the type (1 byte), the length of the key (1 byte), the key, the length of the data (2 bytes) and the data
+// - the CRC32 of the header and records (4 bytes)
+// Numbers are little-endian.
+
+#define FILE_MAGIC   "MCFS"
+#define FILE_VERSION 1
+
+bool Mycila::ConfigFileStorage::begin(const char*) {
+  _values.clear();
+  _dirty = false;
+
+  if (!_fs.exists(_path.c_str()))
+    return true;
+
+  fs::File file = _fs.open(_path.c_str(), "r");
+  if (!file) {
+    LOGE(TAG, "Unable to open %s", _path.c_str());
+    return false;
+  }
+  const size_t size = file.size();
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[size]);
+  const bool read = buffer && file.read(buffer.get(), size) == size;
+  file.close();
+  if (!read) {
+    LOGE(TAG, "Unable to read %s", _path.c_str());
+    return false;
+  }
+
+  const uint8_t* data = buffer.get();
+  if (size < 9 || memcmp(data, FILE_MAGIC, 4) != 0 || data[4] != FILE_VERSION) {
+    LOGE(TAG, "Invalid file: %s", _path.c_str());
+    return false;
+  }
+  const uint32_t crc = data[size - 4] | data[size - 3] << 8 | data[size - 2] << 16 | static_cast<uint32_t>(data[size - 1]) << 24;
+  if (esp_rom_crc32_le(0, data, size - 4) != crc) {
+    LOGE(TAG, "CRC mismatch: %s", _path.c_str());
+    return false;
+  }
+
+  const uint8_t* end = data + size - 4;
+  data += 5;
+  while (data < end) {
+    if (end - data < 2 || end - data < 4 + data[1]) {
+      LOGE(TAG, "Truncated file: %s", _path.c_str());
+      _values.clear();
+      return false;
+    }
+    const ConfigStorageType type = static_cast<ConfigStorageType>(data[0]);
+    std::string key(reinterpret_cast<const char*>(data + 2), data[1]);
+    data += 2 + key.size();
+    const size_t length = data[0] | data[1] << 8;
+    data += 2;
+    if (static_cast<size_t>(end - data) < length) {
+      LOGE(TAG, "Truncated file: %s", _path.c_str());
+      _values.clear();
+      return false;
+    }
+    _values[std::move(key)] = {type, std::string(reinterpret_cast<const char*>(data), length)};
+    data += length;
+  }
+
+  LOGD(TAG, "Loaded %u keys from %s", _values.size(), _path.c_str());
+  return true;
+}
+
+bool Mycila::ConfigFileStorage::commit() {
+  if (!_dirty)
+    return true;
+
+  // written next to the file, then renamed over it
+  const std::string tmp = _path + ".tmp";
+  fs::File file = _fs.open(tmp.c_str(), "w");
+  if (!file) {
+    LOGE(TAG, "Unable to create %s", tmp.c_str());
+    return false;
+  }
+
+  uint32_t crc = 0;
+  bool written = true;
+  auto write = [&](const void* data, size_t length) {
+    crc = esp_rom_crc32_le(crc, static_cast<const uint8_t*>(data), length);
+    written = written && file.write(static_cast<const uint8_t*>(data), length) == length;
+  };
+
+  const uint8_t header[5] = {FILE_MAGIC[0], FILE_MAGIC[1], FILE_MAGIC[2], FILE_MAGIC[3], FILE_VERSION};
+  write(header, sizeof(header));
+  for (const auto& value : _values) {
+    const uint8_t record[2] = {static_cast<uint8_t>(value.second.type), static_cast<uint8_t>(value.first.size())};
+    const uint8_t length[2] = {static_cast<uint8_t>(value.second.data.size()), static_cast<uint8_t>(value.second.data.size() >> 8)};
+    write(record, sizeof(record));
+    write(value.first.data(), value.first.size());
+    write(length, sizeof(length));
+    write(value.second.data.data(), value.second.data.size());
+  }
+  const uint8_t footer[4] = {static_cast<uint8_t>(crc), static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc >> 16), static_cast<uint8_t>(crc >> 24)};
+  written = written && file.write(footer, sizeof(footer)) == sizeof(footer);
+  file.close();
+
+  if (!written || !_fs.rename(tmp.c_str(), _path.c_str())) {
+    LOGE(TAG, "Unable to write %s", _path.c_str());
+    _fs.remove(tmp.c_str());
+    return false;
+  }
+
+  _dirty = false;
+  LOGD(TAG, "Saved %u keys to %s", _values.size(), _path.c_str());
+  return true;
+}
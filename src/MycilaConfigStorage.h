@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023-2024 Mathieu Carbou
+ */
+#pragma once
+
+#include <FS.h>
+#include <Preferences.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <nvs.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Mycila {
+  // type of a persisted value
+  enum class ConfigStorageType : uint8_t {
+    NONE,
+    STRING,
+    BOOL,
+    LONG,
+    FLOAT,
+    // bytes of a chunk of a blob (see Config::configureBlob())
+    BLOB,
+    // persisted with a type not used by Config
+    OTHER,
+  };
+
+  // Persistence of the values of a Config (see Config::begin()).
+  // Config locks its own mutex around the calls: an implementation does not need to be thread-safe.
+  class ConfigStorage {
+    public:
+      virtual ~ConfigStorage() = default;
+
+      // opens the storage: name is the NVS namespace for the NVS storage
+      virtual bool begin(const char* name) = 0;
+      virtual void end() = 0;
+
+      // type of the persisted value, NONE when the key is not persisted
+      virtual ConfigStorageType type(const char* key) const = 0;
+      bool isKey(const char* key) const { return type(key) != ConfigStorageType::NONE; }
+
+      // Reads a string value like nvs_get_str(): with a null buffer, size is set to the length of the value including the null terminator.
+      // returns ESP_OK, ESP_ERR_NVS_NOT_FOUND when the key is not persisted as a string,
+      // or ESP_ERR_NVS_INVALID_LENGTH when the buffer is too small
+      virtual esp_err_t getString(const char* key, char* buffer, size_t* size) const = 0;
+
+      // typed reads: return false when the key is not persisted with this type
+      virtual bool getBool(const char* key, bool& value) const = 0;
+      virtual bool getLong(const char* key, long& value) const = 0; // NOLINT
+      virtual bool getFloat(const char* key, float& value) const = 0;
+
+      // Reads binary data like nvs_get_blob(): with a null buffer, size is set to the length of the data.
+      // Used for the chunks of the blobs: returns ESP_ERR_NVS_NOT_FOUND when the storage does not support them.
+      virtual esp_err_t getBytes(const char*, void*, size_t*) const { return ESP_ERR_NVS_NOT_FOUND; }
+
+      // writes: return the number of bytes written, 0 on failure
+      virtual size_t putString(const char* key, const char* value) = 0;
+      virtual size_t putBool(const char* key, bool value) = 0;
+      virtual size_t putLong(const char* key, long value) = 0; // NOLINT
+      virtual size_t putFloat(const char* key, float value) = 0;
+      virtual size_t putBytes(const char*, const void*, size_t) { return 0; }
+
+      virtual bool remove(const char* key) = 0;
+      virtual bool clear() = 0;
+
+      // calls the callback for each persisted key: the storage must not be modified from the callback
+      virtual void list(std::function<void(const char* key, ConfigStorageType type)> callback) const = 0;
+
+      // Makes the previous writes durable.
+      // Config calls it once after each set(), transaction, restore() or flush(),
+      // so that a storage can group the writes of a bulk change.
+      virtual bool commit() { return true; }
+
+      // Atomic replacement of all the values (see Config::setAtomicRestore()):
+      // between beginStaging() and endStaging(), the writes go to a staging area while the reads still return the current values,
+      // then endStaging(true) replaces the current values by the staged ones at once.
+      // returns false when the storage does not support it
+      virtual bool beginStaging() { return false; }
+      // endStaging(false) discards the staged values
+      virtual bool endStaging(bool) { return false; }
+  };
+
+  // NVS storage (default): each key is an entry of the NVS namespace, written immediately.
+  // Staging uses a second namespace, named after the first one with a trailing ~, which is written with a single NVS commit.
+  // The active namespace is recorded in the "mycila_config" namespace and switched with a single NVS write,
+  // then the previous namespace is erased by a background task.
+  class ConfigNVSStorage : public ConfigStorage {
+    public:
+      ~ConfigNVSStorage() override;
+
+      bool begin(const char* name) override;
+      void end() override;
+      ConfigStorageType type(const char* key) const override;
+      esp_err_t getString(const char* key, char* buffer, size_t* size) const override;
+      bool getBool(const char* key, bool& value) const override;
+      bool getLong(const char* key, long& value) const override; // NOLINT
+      bool getFloat(const char* key, float& value) const override;
+      esp_err_t getBytes(const char* key, void* buffer, size_t* size) const override;
+      size_t putString(const char* key, const char* value) override;
+      size_t putBool(const char* key, bool value) override;
+      size_t putLong(const char* key, long value) override; // NOLINT
+      size_t putFloat(const char* key, float value) override;
+      size_t putBytes(const char* key, const void* data, size_t length) override;
+      bool remove(const char* key) override;
+      bool clear() override;
+      void list(std::function<void(const char* key, ConfigStorageType type)> callback) const override;
+      bool beginStaging() override;
+      bool endStaging(bool apply) override;
+
+      // active NVS namespace
+      const char* name() const { return _active.c_str(); }
+
+    private:
+      mutable Preferences _prefs;
+      // values are read with a separate read-only handle to get their length before reading them
+      nvs_handle_t _handle = 0;
+      // handle of the staging namespace, written without commit until endStaging()
+      nvs_handle_t _staging = 0;
+      // name given to begin(), and index of the active namespace
+      std::string _name;
+      uint8_t _slot = 0;
+      std::string _active;
+      // namespace erased by the background task, and its completion
+      std::string _erasing;
+      SemaphoreHandle_t _erased = nullptr;
+
+      std::string _namespace(uint8_t slot) const;
+      bool _open();
+      void _erase(std::string ns);
+      void _waitErased();
+      static void _eraseTask(void* params);
+  };
+
+  // Volatile storage in RAM: no flash wear, for runtime overrides and host-side benchmarks.
+  // The values are lost when the storage is destroyed.
+  class ConfigRAMStorage : public ConfigStorage {
+    public:
+      bool begin(const char*) override { return true; }
+      void end() override {}
+      ConfigStorageType type(const char* key) const override;
+      esp_err_t getString(const char* key, char* buffer, size_t* size) const override;
+      bool getBool(const char* key, bool& value) const override;
+      bool getLong(const char* key, long& value) const override; // NOLINT
+      bool getFloat(const char* key, float& value) const override;
+      esp_err_t getBytes(const char* key, void* buffer, size_t* size) const override;
+      size_t putString(const char* key, const char* value) override;
+      size_t putBool(const char* key, bool value) override;
+      size_t putLong(const char* key, long value) override; // NOLINT
+      size_t putFloat(const char* key, float value) override;
+      size_t putBytes(const char* key, const void* data, size_t length) override;
+      bool remove(const char* key) override;
+      bool clear() override;
+      void list(std::function<void(const char* key, ConfigStorageType type)> callback) const override;
+
+    protected:
+      struct Value {
+          ConfigStorageType type;
+          // string value, or the bytes of a number
+          std::string data;
+      };
+      // std::less<> allows lookups by const char* without building a string
+      std::map<std::string, Value, std::less<>> _values;
+      // changed since the last commit()
+      bool _dirty = false;
+
+      const Value* _find(const char* key, ConfigStorageType type) const;
+      size_t _put(const char* key, ConfigStorageType type, const void* data, size_t size);
+  };
+
+  // Storage of the whole config in a single file, for example on LittleFS:
+  //   Mycila::ConfigFileStorage storage(LittleFS, "/config.bin");
+  //   config.begin(storage);
+  // The values are kept in RAM and the file is rewritten once per commit(),
+  // so a bulk change of N keys is one sequential file write instead of N NVS writes.
+  // The file is written to a temporary file first, then renamed: a power loss keeps either the old or the new file.
+  class ConfigFileStorage : public ConfigRAMStorage {
+    public:
+      ConfigFileStorage(fs::FS& fs, const char* path) : _fs(fs), _path(path) {}
+      ~ConfigFileStorage() override { commit(); }
+
+      // loads the file: name is not used
+      bool begin(const char* name) override;
+      void end() override { commit(); }
+      bool commit() override;
+
+    private:
+      fs::FS& _fs;
+      std::string _path;
+  };
+} // namespace Mycila